@@ -0,0 +1,180 @@
+/*
+    adversarial.c - pdqsort on inputs that break naive quicksorts.
+
+    Prints the number of comparisons per n*log2(n) for growing n, which
+    stays flat if pdqsort does not degrade to quadratic time, and the counts
+    of the highly unbalanced partitions and of the heapsort fallbacks from
+    pdqsort_stats, which show whether the fallback ran too early.
+
+    make adversarial
+    ./adversarial [max_n]
+
+    Needs CPDQS_STATS, which the Makefile defines.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpdqsort.h"
+
+#if !CPDQS_STATS
+#error "adversarial.c needs the statistics: compile with -DCPDQS_STATS=1"
+#endif
+
+static unsigned long long comparisons;
+
+static int compar_int(void const *a, void const *b)
+{
+    int x = *(int const *)a, y = *(int const *)b;
+    ++comparisons;
+    return (x > y) - (x < y);
+}
+
+
+/* McIlroy's "A Killer Adversary for Quicksort" state. */
+static int *anti_val;
+static int anti_gas, anti_solid, anti_candidate;
+
+static int compar_anti(void const *a, void const *b)
+{
+    int x = *(int const *)a, y = *(int const *)b;
+    if (anti_val[x] == anti_gas && anti_val[y] == anti_gas) {
+        anti_val[x == anti_candidate ? x : y] = anti_solid++;
+    }
+    if (anti_val[x] == anti_gas) {
+        anti_candidate = x;
+    } else if (anti_val[y] == anti_gas) {
+        anti_candidate = y;
+    }
+    return (anti_val[x] > anti_val[y]) - (anti_val[x] < anti_val[y]);
+}
+
+
+static void fill_organ_pipe(int *a, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        a[i] = (int)(i < n / 2 ? i : n - i);
+    }
+}
+
+/* Musser's median-of-3 killer sequence. */
+static void fill_median3_killer(int *a, size_t n)
+{
+    size_t i, k = n / 2;
+    for (i = 1; i <= k; ++i) {
+        a[i - 1] = (int)(i % 2 ? i : k + i - 1);
+        a[k + i - 1] = (int)(2 * i);
+    }
+    if (n % 2) {
+        a[n - 1] = (int)n;
+    }
+}
+
+static void fill_many_duplicates(int *a, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        a[i] = rand() % 16;
+    }
+}
+
+static void fill_all_equal(int *a, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        a[i] = 42;
+    }
+}
+
+/* Input built against pdqsort itself by the killer adversary. */
+static void fill_adversary(int *a, size_t n)
+{
+    size_t i;
+    anti_val = malloc(n * sizeof(int));
+    anti_gas = (int)n;
+    anti_solid = 0;
+    anti_candidate = 0;
+    for (i = 0; i < n; ++i) {
+        a[i] = (int)i;
+        anti_val[i] = anti_gas;
+    }
+    pdqsort(a, n, sizeof(int), compar_anti);
+    for (i = 0; i < n; ++i) {
+        a[i] = anti_val[i];
+    }
+    free(anti_val);
+}
+
+static void fill_random(int *a, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        a[i] = rand();
+    }
+}
+
+
+static struct {
+    char const *name;
+    void (*fill)(int *, size_t);
+} const distributions[] = {
+    {"random", fill_random},
+    {"organ_pipe", fill_organ_pipe},
+    {"median3_killer", fill_median3_killer},
+    {"many_duplicates", fill_many_duplicates},
+    {"all_equal", fill_all_equal},
+    {"adversary", fill_adversary},
+};
+
+
+int main(int argc, char **argv)
+{
+    size_t max_n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t n, i, d;
+    int *a = malloc(max_n * sizeof(int));
+    int variant;
+    struct cpdqs_stats stats;
+    clock_t start;
+    double ns, per_nlogn;
+
+    printf("%-16s %10s %-11s %10s %12s %10s %9s\n",
+        "distribution", "n", "variant", "ns/elem", "cmp/nlog2n", "unbalanced", "heapsorts");
+    for (d = 0; d < sizeof(distributions) / sizeof(distributions[0]); ++d) {
+        for (n = 1000; n <= max_n; n *= 10) {
+            for (variant = 0; variant < 2; ++variant) {
+                srand(1);
+                distributions[d].fill(a, n);
+                comparisons = 0;
+                memset(&stats, 0, sizeof(stats));
+                start = clock();
+                if (variant == 0) {
+                    pdqsort_stats(a, n, sizeof(int), compar_int, &stats);
+                } else {
+                    pdqsort_branchless_stats(a, n, sizeof(int), compar_int, &stats);
+                }
+                ns = (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / (double)n;
+                per_nlogn = (double)comparisons / ((double)n * log2((double)n));
+
+                for (i = 1; i < n; ++i) {
+                    if (a[i] < a[i - 1]) {
+                        fprintf(stderr, "%s: not sorted for n = %lu\n",
+                            distributions[d].name, (unsigned long)n);
+                        return 1;
+                    }
+                }
+
+                printf("%-16s %10lu %-11s %10.2f %12.3f %10lu %9lu\n",
+                    distributions[d].name, (unsigned long)n,
+                    variant == 0 ? "pdqsort" : "branchless", ns, per_nlogn,
+                    (unsigned long)stats.unbalanced, (unsigned long)stats.heapsorts);
+            }
+        }
+    }
+
+    free(a);
+    return 0;
+}
@@ -0,0 +1,476 @@
+/*
+    bench.c - pdqsort against heapsort, qsort and std::sort.
+
+    Sorts the standard pdqsort input distributions for a range of element
+    sizes and lengths, and prints the time and the number of comparisons
+    per element. All the sorts call the same comparison function through
+    a pointer. Elements hold a key of up to 4 bytes at the beginning, the
+    rest is payload.
+
+    ./bench [-c] [-n max_n] [-N min_n] [-s sizes] [-d distributions]
+            [-a algorithms] [-m max_mib]
+
+    Distributions: random, sorted, reverse, organ_pipe, sawtooth,
+    few_unique, random_tail. Algorithms: pdqsort, pdqsort_branchless,
+    pdqsort_parallel, pdqsort_parallel_branchless (one thread per CPU,
+    comparisons not counted), heapsort, qsort, std_sort (element sizes 1,
+    2, 4, 8, 12, 16, 24, 32, 48, 64, 128, 256, 512 and 1024 only).
+
+    -c      CSV output
+    -n, -N  largest and smallest n, going by x10 (default 10 to 10^6)
+    -s      comma-separated element sizes, 1 to 1024 (default 1,2,4,...,256)
+    -d, -a  comma-separated names to run (default all)
+    -m      skip the arrays larger than this many MiB (default 1024)
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpdqsort.h"
+#include "cpdqsort_parallel.h"
+
+
+/* Defined in std_sort.cc, returns 0 for unsupported element sizes. */
+int bench_std_sort(
+    void *base, size_t nmemb, size_t size, int (*compar)(void const *, void const *));
+
+
+static unsigned long long comparisons;
+
+static uint32_t get_key(void const *p, size_t size)
+{
+    uint8_t k8;
+    uint16_t k16;
+    uint32_t k32;
+
+    switch (size) {
+    case 1:
+        memcpy(&k8, p, 1);
+        return k8;
+    case 2:
+    case 3:
+        memcpy(&k16, p, 2);
+        return k16;
+    default:
+        memcpy(&k32, p, 4);
+        return k32;
+    }
+}
+
+/*
+The uncounted ones are for the parallel sorts, which would race on the
+count.
+*/
+#define DEFINE_COMPAR(name, uncounted_name, type) \
+    static int uncounted_name(void const *a, void const *b) \
+    { \
+        type x, y; \
+        memcpy(&x, a, sizeof(x)); \
+        memcpy(&y, b, sizeof(y)); \
+        return (x > y) - (x < y); \
+    } \
+    static int name(void const *a, void const *b) \
+    { \
+        ++comparisons; \
+        return uncounted_name(a, b); \
+    }
+
+DEFINE_COMPAR(compar_u8, uncounted_u8, uint8_t)
+DEFINE_COMPAR(compar_u16, uncounted_u16, uint16_t)
+DEFINE_COMPAR(compar_u32, uncounted_u32, uint32_t)
+
+static int (*compar_for(size_t size))(void const *, void const *)
+{
+    return size == 1 ? compar_u8 : size < 4 ? compar_u16 : compar_u32;
+}
+
+static int (*uncounted_for(size_t size))(void const *, void const *)
+{
+    return size == 1 ? uncounted_u8 : size < 4 ? uncounted_u16 : uncounted_u32;
+}
+
+
+/* xorshift64*, so that the inputs do not depend on the libc rand. */
+static uint64_t rng_state;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+
+/* Distributions, as 32-bit keys in [0, n) or random */
+static void fill_random(uint32_t *k, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        k[i] = rng();
+    }
+}
+
+static void fill_sorted(uint32_t *k, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        k[i] = (uint32_t)i;
+    }
+}
+
+static void fill_reverse(uint32_t *k, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        k[i] = (uint32_t)(n - 1 - i);
+    }
+}
+
+static void fill_organ_pipe(uint32_t *k, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        k[i] = (uint32_t)(i < n / 2 ? i : n - 1 - i);
+    }
+}
+
+/* Eight ascending runs */
+static void fill_sawtooth(uint32_t *k, size_t n)
+{
+    size_t i, period = n / 8 + 1;
+    for (i = 0; i < n; ++i) {
+        k[i] = (uint32_t)(i % period * 8);
+    }
+}
+
+static void fill_few_unique(uint32_t *k, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        k[i] = (uint32_t)(rng() % 16 * (n / 16));
+    }
+}
+
+/* Sorted, except for the last 10% */
+static void fill_random_tail(uint32_t *k, size_t n)
+{
+    size_t i;
+    fill_sorted(k, n);
+    for (i = n - n / 10; i < n; ++i) {
+        k[i] = (uint32_t)(rng() % (n + 1));
+    }
+}
+
+static struct {
+    char const *name;
+    void (*fill)(uint32_t *, size_t);
+} const distributions[] = {
+    {"random", fill_random},
+    {"sorted", fill_sorted},
+    {"reverse", fill_reverse},
+    {"organ_pipe", fill_organ_pipe},
+    {"sawtooth", fill_sawtooth},
+    {"few_unique", fill_few_unique},
+    {"random_tail", fill_random_tail},
+};
+
+
+/* Sorts, returning 0 if not available for the element size */
+static int sort_pdqsort(void *base, size_t nmemb, size_t size, int (*compar)(void const *, void const *))
+{
+    pdqsort(base, nmemb, size, compar);
+    return 1;
+}
+
+static int sort_pdqsort_branchless(
+        void *base, size_t nmemb, size_t size, int (*compar)(void const *, void const *))
+{
+    pdqsort_branchless(base, nmemb, size, compar);
+    return 1;
+}
+
+static int sort_pdqsort_parallel(
+        void *base, size_t nmemb, size_t size, int (*compar)(void const *, void const *))
+{
+    (void)compar;
+    pdqsort_parallel(base, nmemb, size, uncounted_for(size), 0);
+    return 1;
+}
+
+static int sort_pdqsort_parallel_branchless(
+        void *base, size_t nmemb, size_t size, int (*compar)(void const *, void const *))
+{
+    (void)compar;
+    pdqsort_parallel_branchless(base, nmemb, size, uncounted_for(size), 0);
+    return 1;
+}
+
+static int sort_heapsort(void *base, size_t nmemb, size_t size, int (*compar)(void const *, void const *))
+{
+    heapsort(base, nmemb, size, compar);
+    return 1;
+}
+
+static int sort_qsort(void *base, size_t nmemb, size_t size, int (*compar)(void const *, void const *))
+{
+    qsort(base, nmemb, size, compar);
+    return 1;
+}
+
+static struct {
+    char const *name;
+    int (*sort)(void *, size_t, size_t, int (*)(void const *, void const *));
+} const algorithms[] = {
+    {"pdqsort", sort_pdqsort},
+    {"pdqsort_branchless", sort_pdqsort_branchless},
+    {"pdqsort_parallel", sort_pdqsort_parallel},
+    {"pdqsort_parallel_branchless", sort_pdqsort_parallel_branchless},
+    {"heapsort", sort_heapsort},
+    {"qsort", sort_qsort},
+    {"std_sort", bench_std_sort},
+};
+
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Each measurement sorts at least this many elements in total. */
+#define MIN_WORK 1000000
+
+/* Short arrays are copied into batches of about this many bytes. */
+#define BATCH_BYTES (4u << 20)
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Is name in the comma-separated list (NULL meaning all)? */
+static int selected(char const *list, char const *name)
+{
+    size_t len = strlen(name);
+    char const *p = list;
+
+    if (list == NULL) {
+        return 1;
+    }
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) {
+            return 1;
+        }
+        p += len;
+    }
+    return 0;
+}
+
+/* Builds the elements from the keys, scaled down to fit narrow keys. */
+static void make_elements(unsigned char *elems, uint32_t const *keys, size_t n, size_t size)
+{
+    size_t i, j, key_bytes = size == 1 ? 1 : size < 4 ? 2 : 4;
+    uint64_t range = (uint64_t)1 << (8 * key_bytes), k;
+    uint8_t k8;
+    uint16_t k16;
+    uint32_t k32;
+    int scale = key_bytes < 4 && (uint64_t)n > range;
+    int is_random = 0;
+
+    for (i = 0; i < n && !is_random; ++i) {
+        is_random = keys[i] > n;
+    }
+    for (i = 0; i < n; ++i) {
+        unsigned char *e = elems + i * size;
+        k = keys[i];
+        if (is_random) {
+            k %= range;
+        } else if (scale) {
+            k = k * range / ((uint64_t)n + 1);
+        }
+        switch (key_bytes) {
+        case 1:
+            k8 = (uint8_t)k;
+            memcpy(e, &k8, 1);
+            break;
+        case 2:
+            k16 = (uint16_t)k;
+            memcpy(e, &k16, 2);
+            break;
+        default:
+            k32 = (uint32_t)k;
+            memcpy(e, &k32, 4);
+        }
+        for (j = key_bytes; j < size; ++j) {
+            e[j] = (unsigned char)(i + j);
+        }
+    }
+}
+
+static int is_sorted(unsigned char const *elems, size_t n, size_t size)
+{
+    size_t i;
+    for (i = 1; i < n; ++i) {
+        if (get_key(elems + i * size, size) < get_key(elems + (i - 1) * size, size)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+int main(int argc, char **argv)
+{
+    static size_t const default_sizes[] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+    size_t sizes[64], nsizes = 0;
+    size_t min_n = 10, max_n = 1000000, max_mib = 1024;
+    char const *dist_list = NULL, *alg_list = NULL;
+    int csv = 0, opt;
+    size_t s, d, a, n, size, reps, batch, done, b;
+    uint32_t *keys;
+    unsigned char *input, *work;
+    int (*compar)(void const *, void const *);
+    double start, elapsed;
+    char *p;
+
+    while ((opt = getopt(argc, argv, "chn:N:s:d:a:m:")) != -1) {
+        switch (opt) {
+        case 'c':
+            csv = 1;
+            break;
+        case 'n':
+            max_n = strtoul(optarg, NULL, 10);
+            break;
+        case 'N':
+            min_n = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            for (p = optarg; *p != '\0' && nsizes < COUNT(sizes); p += *p == ',') {
+                sizes[nsizes] = strtoul(p, &p, 10);
+                if (sizes[nsizes] < 1 || sizes[nsizes] > 1024) {
+                    fprintf(stderr, "element sizes must be 1 to 1024\n");
+                    return 2;
+                }
+                ++nsizes;
+            }
+            break;
+        case 'd':
+            dist_list = optarg;
+            break;
+        case 'a':
+            alg_list = optarg;
+            break;
+        case 'm':
+            max_mib = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(opt == 'h' ? stdout : stderr,
+                "usage: %s [-c] [-n max_n] [-N min_n] [-s sizes] "
+                "[-d distributions] [-a algorithms] [-m max_mib]\n", argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (nsizes == 0) {
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+        nsizes = COUNT(default_sizes);
+    }
+    if (min_n < 1) {
+        min_n = 1;
+    }
+
+    if (csv) {
+        printf("algorithm,distribution,size,n,ns_per_elem,cmp_per_elem\n");
+    } else {
+        printf("%-27s %-12s %5s %10s %10s %10s\n",
+            "algorithm", "distribution", "size", "n", "ns/elem", "cmp/elem");
+    }
+
+    for (s = 0; s < nsizes; ++s) {
+        size = sizes[s];
+        compar = compar_for(size);
+        for (n = min_n; n <= max_n; n *= 10) {
+            if ((double)n * (double)size * 2 > (double)max_mib * 1048576.0) {
+                break;
+            }
+            reps = n >= MIN_WORK ? 1 : MIN_WORK / n;
+            batch = BATCH_BYTES / (n * size);
+            batch = batch < 1 ? 1 : batch > reps ? reps : batch;
+
+            keys = malloc(n * sizeof(*keys));
+            input = malloc(n * size);
+            work = malloc(batch * n * size);
+            if (keys == NULL || input == NULL || work == NULL) {
+                fprintf(stderr, "out of memory for n = %lu, size = %lu\n",
+                    (unsigned long)n, (unsigned long)size);
+                return 1;
+            }
+
+            for (d = 0; d < COUNT(distributions); ++d) {
+                if (!selected(dist_list, distributions[d].name)) {
+                    continue;
+                }
+                rng_state = 0x9E3779B97F4A7C15ULL;
+                distributions[d].fill(keys, n);
+                make_elements(input, keys, n, size);
+
+                for (a = 0; a < COUNT(algorithms); ++a) {
+                    if (!selected(alg_list, algorithms[a].name)) {
+                        continue;
+                    }
+                    elapsed = 0;
+                    comparisons = 0;
+                    for (done = 0; done < reps; done += batch) {
+                        for (b = 0; b < batch; ++b) {
+                            memcpy(work + b * n * size, input, n * size);
+                        }
+                        start = now();
+                        for (b = 0; b < batch; ++b) {
+                            if (!algorithms[a].sort(work + b * n * size, n, size, compar)) {
+                                break;
+                            }
+                        }
+                        elapsed += now() - start;
+                        if (b < batch) {
+                            break;
+                        }
+                        if (!is_sorted(work, n, size)) {
+                            fprintf(stderr, "%s: not sorted, %s, size %lu, n %lu\n",
+                                algorithms[a].name, distributions[d].name,
+                                (unsigned long)size, (unsigned long)n);
+                            return 1;
+                        }
+                    }
+                    if (done < reps) {
+                        continue;
+                    }
+
+                    if (csv) {
+                        printf("%s,%s,%lu,%lu,%.3f,%.3f\n",
+                            algorithms[a].name, distributions[d].name,
+                            (unsigned long)size, (unsigned long)n,
+                            elapsed * 1e9 / ((double)done * (double)n),
+                            (double)comparisons / ((double)done * (double)n));
+                    } else {
+                        printf("%-27s %-12s %5lu %10lu %10.2f %10.2f\n",
+                            algorithms[a].name, distributions[d].name,
+                            (unsigned long)size, (unsigned long)n,
+                            elapsed * 1e9 / ((double)done * (double)n),
+                            (double)comparisons / ((double)done * (double)n));
+                    }
+                    fflush(stdout);
+                }
+            }
+
+            free(keys);
+            free(input);
+            free(work);
+        }
+    }
+    return 0;
+}
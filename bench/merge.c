@@ -0,0 +1,209 @@
+/*
+    merge.c - pdqsort_merge and pdqsort_merge_parallel on presorted shards.
+
+    Cuts n random keys into k shards of random lengths, sorts each of them,
+    then merges them with pdqsort_merge and with pdqsort_merge_parallel on
+    each of the given numbers of threads, and prints the time per element,
+    the fastest of 3 runs. Checks that every output is the stable merge of
+    the shards: the keys in order, the equal ones in the order of the
+    shards, each element exactly once.
+
+    ./merge [-n n] [-k shards] [-t threads] [-u unique]
+
+    -n      total number of elements (default 2000000)
+    -k      comma-separated numbers of shards (default 2,16,256,16384)
+    -t      comma-separated numbers of threads (default 1,2,4,64)
+    -u      number of distinct keys, 0 for any (default 0)
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpdqsort_parallel.h"
+
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/* The fastest of this many runs counts. */
+#define REPEATS 3
+
+/* A key, and the position of the element in the shards */
+struct elem {
+    uint64_t key;
+    uint64_t tag;
+};
+
+static int compar_elem(void const *a, void const *b)
+{
+    uint64_t x = ((struct elem const *)a)->key, y = ((struct elem const *)b)->key;
+    return (x > y) - (x < y);
+}
+
+static int compar_u64(void const *a, void const *b)
+{
+    uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
+
+
+/* xorshift64*, the same as in bench */
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Parses a comma-separated list of numbers, returns how many there were. */
+static size_t parse_list(char const *s, size_t *list, size_t max)
+{
+    size_t n = 0;
+    char *p = (char *)s;
+
+    while (*p != '\0' && n < max) {
+        list[n++] = strtoul(p, &p, 10);
+        p += *p == ',';
+    }
+    return n;
+}
+
+/*
+Is out the stable merge of the shards in the input? Their elements are
+tagged with their positions, so the tags of equal keys must go up, and
+every tag must come with the key it had in the input.
+*/
+static int is_merged(struct elem const *out, struct elem const *in, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        if (out[i].tag >= n || in[out[i].tag].key != out[i].key) {
+            return 0;
+        }
+        if (i > 0 && (out[i].key < out[i - 1].key ||
+                (out[i].key == out[i - 1].key && out[i].tag <= out[i - 1].tag))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+int main(int argc, char **argv)
+{
+    size_t n = 2000000, unique = 0;
+    size_t shards[64] = {2, 16, 256, 16384}, nshards = 4;
+    size_t threads[64] = {1, 2, 4, 64}, nthreads = 4;
+    size_t s, t, i, k, r;
+    int opt;
+    struct elem *in, *out;
+    struct cpdqs_segment *segs;
+    uint64_t *cuts;
+    double start, best;
+
+    while ((opt = getopt(argc, argv, "hn:k:t:u:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            nshards = parse_list(optarg, shards, COUNT(shards));
+            break;
+        case 't':
+            nthreads = parse_list(optarg, threads, COUNT(threads));
+            break;
+        case 'u':
+            unique = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(opt == 'h' ? stdout : stderr,
+                "usage: %s [-n n] [-k shards] [-t threads] [-u unique]\n", argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    printf("%-22s %8s %7s %10s\n", "algorithm", "shards", "threads", "ns/elem");
+
+    for (s = 0; s < nshards; ++s) {
+        k = shards[s];
+        in = malloc(n * sizeof(*in));
+        out = malloc(n * sizeof(*out));
+        segs = malloc(k * sizeof(*segs));
+        cuts = malloc((k + 1) * sizeof(*cuts));
+        if (n == 0 || k == 0 || in == NULL || out == NULL || segs == NULL || cuts == NULL) {
+            fprintf(stderr, "cannot merge %lu elements in %lu shards\n",
+                (unsigned long)n, (unsigned long)k);
+            return 1;
+        }
+
+        for (i = 0; i < n; ++i) {
+            in[i].key = unique > 0 ? rng() % unique : rng();
+        }
+        cuts[0] = 0;
+        cuts[k] = n;
+        for (i = 1; i < k; ++i) {
+            cuts[i] = rng() % (n + 1);
+        }
+        pdqsort(cuts, k + 1, sizeof(*cuts), compar_u64);
+        for (i = 0; i < k; ++i) {
+            segs[i].base = in + cuts[i];
+            segs[i].nmemb = cuts[i + 1] - cuts[i];
+            pdqsort_stable(segs[i].base, segs[i].nmemb, sizeof(*in), compar_elem);
+        }
+        for (i = 0; i < n; ++i) {
+            in[i].tag = i;
+        }
+
+        /* Threads 0 stands for pdqsort_merge */
+        for (t = 0; t <= nthreads; ++t) {
+            best = -1;
+            for (r = 0; r < REPEATS; ++r) {
+                memset(out, 0xff, n * sizeof(*out));
+                start = now();
+                if (t == 0) {
+                    pdqsort_merge(segs, k, sizeof(*in), compar_elem, out);
+                } else {
+                    pdqsort_merge_parallel(
+                        segs, k, sizeof(*in), compar_elem, out, (unsigned int)threads[t - 1]);
+                }
+                start = now() - start;
+                if (best < 0 || start < best) {
+                    best = start;
+                }
+                if (!is_merged(out, in, n)) {
+                    fprintf(stderr, "not merged: %lu shards, %s %lu threads\n",
+                        (unsigned long)k, t == 0 ? "sequential," : "parallel,",
+                        (unsigned long)(t == 0 ? 1 : threads[t - 1]));
+                    return 1;
+                }
+            }
+            printf("%-22s %8lu %7lu %10.2f\n",
+                t == 0 ? "pdqsort_merge" : "pdqsort_merge_parallel", (unsigned long)k,
+                (unsigned long)(t == 0 ? 1 : threads[t - 1]), best * 1e9 / (double)n);
+            fflush(stdout);
+        }
+
+        free(in);
+        free(out);
+        free(segs);
+        free(cuts);
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+/*
+    std_sort.cc - std::sort for bench.c, on elements of a fixed size.
+
+    Calls the same comparison function as the C sorts through a pointer,
+    so that only the algorithms differ.
+*/
+
+#include <algorithm>
+#include <cstddef>
+
+
+namespace {
+
+template <std::size_t N>
+struct element {
+    unsigned char bytes[N];
+};
+
+template <std::size_t N>
+void sort_n(void *base, std::size_t nmemb, int (*compar)(void const *, void const *))
+{
+    element<N> *begin = static_cast<element<N> *>(base);
+    std::sort(begin, begin + nmemb, [compar](element<N> const &a, element<N> const &b) {
+        return compar(&a, &b) < 0;
+    });
+}
+
+}  // namespace
+
+
+extern "C" int bench_std_sort(
+    void *base, std::size_t nmemb, std::size_t size, int (*compar)(void const *, void const *))
+{
+    switch (size) {
+    case 1: sort_n<1>(base, nmemb, compar); return 1;
+    case 2: sort_n<2>(base, nmemb, compar); return 1;
+    case 4: sort_n<4>(base, nmemb, compar); return 1;
+    case 8: sort_n<8>(base, nmemb, compar); return 1;
+    case 12: sort_n<12>(base, nmemb, compar); return 1;
+    case 16: sort_n<16>(base, nmemb, compar); return 1;
+    case 24: sort_n<24>(base, nmemb, compar); return 1;
+    case 32: sort_n<32>(base, nmemb, compar); return 1;
+    case 48: sort_n<48>(base, nmemb, compar); return 1;
+    case 64: sort_n<64>(base, nmemb, compar); return 1;
+    case 128: sort_n<128>(base, nmemb, compar); return 1;
+    case 256: sort_n<256>(base, nmemb, compar); return 1;
+    case 512: sort_n<512>(base, nmemb, compar); return 1;
+    case 1024: sort_n<1024>(base, nmemb, compar); return 1;
+    default: return 0;
+    }
+}
@@ -0,0 +1,444 @@
+/*
+    tune.c - Finds the thresholds of cpdqsort.h for this machine.
+
+    Sorts arrays of the given element size with the given comparator, and
+    tries the candidate values of CPDQS_ISRT_THRESHOLD, CPDQS_PISRT_LIMIT,
+    CPDQS_T9THER and CPDQS_UNBALANCED_DIV one at a time, keeping the fastest,
+    until a round over all of them changes nothing. Unless they are still
+    faster than the defaults of cpdqsort.h when measured once more, it
+    keeps the defaults. Then prints the values as a header snippet, to be
+    included before cpdqsort.h.
+
+    ./tune [-b] [-s size] [-k key|memcmp] [-n n] [-d distributions]
+           [-r repeats] [-o file]
+
+    -b      tune pdqsort_branchless rather than pdqsort
+    -s      element size, 1 to 1024 (default 8)
+    -k      comparator: the key of up to 4 bytes at the beginning of the
+            element, as in bench, or memcmp of the whole element (default key)
+    -n      array length (default 100000)
+    -d      comma-separated distributions, out of those of bench (default
+            random,few_unique,random_tail)
+    -r      times each measurement is repeated, the fastest one counts
+            (default 5)
+    -o      write the snippet to the file instead of stdout
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* The thresholds read by the sort, changed between the measurements */
+static size_t isrt_threshold = 24;
+static size_t pisrt_limit = 8;
+static size_t t9ther = 128;
+static size_t unbalanced_div = 8;
+
+#define CPDQS_ISRT_THRESHOLD isrt_threshold
+#define CPDQS_PISRT_LIMIT pisrt_limit
+#define CPDQS_T9THER t9ther
+#define CPDQS_UNBALANCED_DIV unbalanced_div
+
+#include "cpdqsort.h"
+
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static struct {
+    char const *name;
+    size_t *value;
+    size_t ncandidates;
+    size_t candidates[8];
+} const params[] = {
+    {"CPDQS_ISRT_THRESHOLD", &isrt_threshold, 8, {8, 12, 16, 20, 24, 32, 40, 48}},
+    {"CPDQS_PISRT_LIMIT", &pisrt_limit, 6, {0, 2, 4, 8, 16, 32}},
+    {"CPDQS_T9THER", &t9ther, 6, {32, 64, 128, 256, 512, 1024}},
+    {"CPDQS_UNBALANCED_DIV", &unbalanced_div, 5, {4, 6, 8, 12, 16}},
+};
+
+/* A change has to save this much of the time to be taken, against the noise. */
+#define MIN_GAIN 0.01
+
+
+/* Comparators of the key of 1, 2 or 4 bytes at the beginning, as in bench */
+#define DEFINE_COMPAR(name, type) \
+    static int name(void const *a, void const *b) \
+    { \
+        type x, y; \
+        memcpy(&x, a, sizeof(x)); \
+        memcpy(&y, b, sizeof(y)); \
+        return (x > y) - (x < y); \
+    }
+
+DEFINE_COMPAR(compar_u8, uint8_t)
+DEFINE_COMPAR(compar_u16, uint16_t)
+DEFINE_COMPAR(compar_u32, uint32_t)
+
+static size_t key_size;
+
+static size_t memcmp_size;
+
+static int compar_memcmp(void const *a, void const *b)
+{
+    return memcmp(a, b, memcmp_size);
+}
+
+
+/* xorshift64*, the same as in bench */
+static uint64_t rng_state;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+
+/* Distributions, as 32-bit keys */
+static void fill_random(uint32_t *k, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        k[i] = rng();
+    }
+}
+
+static void fill_sorted(uint32_t *k, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        k[i] = (uint32_t)i;
+    }
+}
+
+static void fill_reverse(uint32_t *k, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        k[i] = (uint32_t)(n - 1 - i);
+    }
+}
+
+static void fill_organ_pipe(uint32_t *k, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        k[i] = (uint32_t)(i < n / 2 ? i : n - 1 - i);
+    }
+}
+
+static void fill_sawtooth(uint32_t *k, size_t n)
+{
+    size_t i, period = n / 8 + 1;
+    for (i = 0; i < n; ++i) {
+        k[i] = (uint32_t)(i % period * 8);
+    }
+}
+
+static void fill_few_unique(uint32_t *k, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        k[i] = (uint32_t)(rng() % 16 * (n / 16));
+    }
+}
+
+static void fill_random_tail(uint32_t *k, size_t n)
+{
+    size_t i;
+    fill_sorted(k, n);
+    for (i = n - n / 10; i < n; ++i) {
+        k[i] = (uint32_t)(rng() % (n + 1));
+    }
+}
+
+static struct {
+    char const *name;
+    void (*fill)(uint32_t *, size_t);
+} const distributions[] = {
+    {"random", fill_random},
+    {"sorted", fill_sorted},
+    {"reverse", fill_reverse},
+    {"organ_pipe", fill_organ_pipe},
+    {"sawtooth", fill_sawtooth},
+    {"few_unique", fill_few_unique},
+    {"random_tail", fill_random_tail},
+};
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Is name in the comma-separated list? */
+static int selected(char const *list, char const *name)
+{
+    size_t len = strlen(name);
+    char const *p = list;
+
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) {
+            return 1;
+        }
+        p += len;
+    }
+    return 0;
+}
+
+/*
+Builds the elements from the keys, scaled down to fit narrow keys as in
+bench. For memcmp they go big-endian, so that it orders them the same way
+as the key comparators.
+*/
+static void make_elements(
+        unsigned char *elems, uint32_t const *keys, size_t n, size_t size, int big_endian)
+{
+    size_t i, j;
+    uint64_t range = (uint64_t)1 << (8 * key_size);
+    int scale = key_size < 4 && (uint64_t)n > range;
+    int is_random = 0;
+    uint8_t k8;
+    uint16_t k16;
+    uint32_t k;
+
+    for (i = 0; i < n && !is_random; ++i) {
+        is_random = keys[i] > n;
+    }
+    for (i = 0; i < n; ++i) {
+        unsigned char *e = elems + i * size;
+        k = (uint32_t)(is_random ? keys[i] % range :
+            scale ? keys[i] * range / ((uint64_t)n + 1) : keys[i]);
+        if (big_endian) {
+            for (j = 0; j < key_size; ++j) {
+                e[j] = (unsigned char)(k >> (8 * (key_size - 1 - j)));
+            }
+        } else if (key_size == 1) {
+            k8 = (uint8_t)k;
+            memcpy(e, &k8, 1);
+        } else if (key_size == 2) {
+            k16 = (uint16_t)k;
+            memcpy(e, &k16, 2);
+        } else {
+            memcpy(e, &k, 4);
+        }
+        for (j = key_size; j < size; ++j) {
+            e[j] = (unsigned char)(i + j);
+        }
+    }
+}
+
+
+/* Test inputs, one per selected distribution */
+static unsigned char **inputs;
+static size_t ninputs;
+
+/*
+Seconds the sort takes over all the inputs, the fastest of repeats runs for
+each. Exits if the result is not sorted.
+*/
+static double measure(
+        unsigned char *work, size_t n, size_t size,
+        int (*compar)(void const *, void const *), int branchless, int repeats)
+{
+    double total = 0, best, start, t;
+    size_t i, j;
+    int r;
+
+    for (i = 0; i < ninputs; ++i) {
+        best = -1;
+        for (r = 0; r < repeats; ++r) {
+            memcpy(work, inputs[i], n * size);
+            start = now();
+            if (branchless) {
+                pdqsort_branchless(work, n, size, compar);
+            } else {
+                pdqsort(work, n, size, compar);
+            }
+            t = now() - start;
+            best = best < 0 || t < best ? t : best;
+        }
+        for (j = 1; j < n; ++j) {
+            if (compar(work + (j - 1) * size, work + j * size) > 0) {
+                fprintf(stderr, "not sorted\n");
+                exit(1);
+            }
+        }
+        total += best;
+    }
+    return total;
+}
+
+
+int main(int argc, char **argv)
+{
+    size_t size = 8, n = 100000;
+    char const *dist_list = "random,few_unique,random_tail", *key = "key", *out_path = NULL;
+    int branchless = 0, repeats = 5, opt, changed, round;
+    int (*compar)(void const *, void const *);
+    uint32_t *keys;
+    unsigned char *work;
+    size_t d, p, c, best_value;
+    size_t start[COUNT(params)], tuned[COUNT(params)];
+    double base, best, t;
+    FILE *out;
+
+    while ((opt = getopt(argc, argv, "hbs:k:n:d:r:o:")) != -1) {
+        switch (opt) {
+        case 'b':
+            branchless = 1;
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            key = optarg;
+            break;
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            dist_list = optarg;
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            fprintf(opt == 'h' ? stdout : stderr,
+                "usage: %s [-b] [-s size] [-k key|memcmp] [-n n] [-d distributions] "
+                "[-r repeats] [-o file]\n", argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (size < 1 || size > 1024 || n < 2 || repeats < 1 ||
+            (strcmp(key, "key") != 0 && strcmp(key, "memcmp") != 0)) {
+        fprintf(stderr, "bad arguments, see %s -h\n", argv[0]);
+        return 2;
+    }
+    /* The default of cpdqsort.h for the size */
+    isrt_threshold = size <= 64 ? 24 : size <= 128 ? 16 : 12;
+    key_size = size == 1 ? 1 : size < 4 ? 2 : 4;
+    memcmp_size = size;
+    compar = strcmp(key, "memcmp") == 0 ? compar_memcmp :
+        key_size == 1 ? compar_u8 : key_size == 2 ? compar_u16 : compar_u32;
+
+    keys = malloc(n * sizeof(*keys));
+    work = malloc(n * size);
+    inputs = malloc(COUNT(distributions) * sizeof(*inputs));
+    if (keys == NULL || work == NULL || inputs == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (d = 0; d < COUNT(distributions); ++d) {
+        if (!selected(dist_list, distributions[d].name)) {
+            continue;
+        }
+        inputs[ninputs] = malloc(n * size);
+        if (inputs[ninputs] == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        rng_state = 0x9E3779B97F4A7C15ULL;
+        distributions[d].fill(keys, n);
+        make_elements(inputs[ninputs++], keys, n, size, compar == compar_memcmp);
+    }
+    if (ninputs == 0) {
+        fprintf(stderr, "no distributions selected\n");
+        return 2;
+    }
+
+    for (p = 0; p < COUNT(params); ++p) {
+        start[p] = *params[p].value;
+    }
+    best = measure(work, n, size, compar, branchless, repeats);
+    fprintf(stderr, "start: %.2f ns/elem\n", best / (double)(ninputs * n) * 1e9);
+    for (round = 1, changed = 1; changed && round <= 4; ++round) {
+        changed = 0;
+        for (p = 0; p < COUNT(params); ++p) {
+            best_value = *params[p].value;
+            for (c = 0; c < params[p].ncandidates; ++c) {
+                if (params[p].candidates[c] == best_value) {
+                    continue;
+                }
+                *params[p].value = params[p].candidates[c];
+                t = measure(work, n, size, compar, branchless, repeats);
+                if (t < best * (1 - MIN_GAIN)) {
+                    best = t;
+                    best_value = params[p].candidates[c];
+                    changed = 1;
+                }
+            }
+            *params[p].value = best_value;
+            /* Measured again, so that a lucky run does not stay the mark to beat */
+            best = measure(work, n, size, compar, branchless, repeats);
+            fprintf(stderr, "round %d: %s %lu, %.2f ns/elem\n", round, params[p].name,
+                (unsigned long)best_value, best / (double)(ninputs * n) * 1e9);
+        }
+    }
+
+    /* The noise adds up over the rounds, so the result has to beat the start once more. */
+    for (p = 0; p < COUNT(params); ++p) {
+        tuned[p] = *params[p].value;
+    }
+    base = best = -1;
+    for (round = 0; round < 3; ++round) {
+        for (p = 0; p < COUNT(params); ++p) {
+            *params[p].value = start[p];
+        }
+        t = measure(work, n, size, compar, branchless, repeats);
+        base = base < 0 || t < base ? t : base;
+        for (p = 0; p < COUNT(params); ++p) {
+            *params[p].value = tuned[p];
+        }
+        t = measure(work, n, size, compar, branchless, repeats);
+        best = best < 0 || t < best ? t : best;
+    }
+    if (best >= base * (1 - MIN_GAIN)) {
+        fprintf(stderr, "no gain over the start, keeping it\n");
+        for (p = 0; p < COUNT(params); ++p) {
+            *params[p].value = start[p];
+        }
+        best = base;
+    }
+
+    out = out_path != NULL ? fopen(out_path, "w") : stdout;
+    if (out == NULL) {
+        perror(out_path);
+        return 1;
+    }
+    fprintf(out,
+        "/*\n"
+        "    cpdqsort thresholds found by\n"
+        "    bench/tune%s -s %lu -k %s -n %lu -d %s\n"
+        "    %.2f ns/elem, %.2f with the defaults\n"
+        "*/\n",
+        branchless ? " -b" : "", (unsigned long)size, key, (unsigned long)n, dist_list,
+        best / (double)(ninputs * n) * 1e9, base / (double)(ninputs * n) * 1e9);
+    for (p = 0; p < COUNT(params); ++p) {
+        fprintf(out, "#define %s %lu\n", params[p].name, (unsigned long)*params[p].value);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    for (d = 0; d < ninputs; ++d) {
+        free(inputs[d]);
+    }
+    free(inputs);
+    free(keys);
+    free(work);
+    return 0;
+}
@@ -0,0 +1,361 @@
+/*
+    variants.c - the special-purpose sorts against the sort they replace.
+
+    Runs each of the radix sorts, the typed sort of CPDQS_DEFINE_NUM_SORT,
+    pdqselect, pdqsort_partial, pdqsort_many and pdqsort_r on random 64-bit
+    keys, and the sort that would do the same job without it: the typed
+    pdqsort of CPDQS_DEFINE_SORT for the radix and typed sorts, pdqsort for
+    the rest. Prints the time per element of both,
+    the fastest of 3 runs, and checks that every result is the one the
+    other sort gives.
+
+    ./variants [-n sizes]
+
+    -n      comma-separated numbers of elements (default 100,10000,1000000)
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CPDQS_RADIX 1
+#include "cpdqsort.h"
+
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/* The fastest of this many runs counts. */
+#define REPEATS 3
+
+/* pdqsort_many sorts arrays of 1 to twice this many elements. */
+#define MANY_LEN 16
+
+CPDQS_DEFINE_SORT(sort_u64, uint64_t, *a < *b)
+CPDQS_DEFINE_SORT(sort_i64, int64_t, *a < *b)
+CPDQS_DEFINE_SORT(sort_f64, double, *a < *b)
+CPDQS_DEFINE_NUM_SORT(num_sort_u64, uint64_t)
+
+static int compar_u64(void const *a, void const *b)
+{
+    uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
+
+/* Orders by the keys xor the mask, the same for pdqsort_r and pdqsort. */
+static uint64_t xor_mask;
+
+static int compar_xor(void const *a, void const *b)
+{
+    uint64_t x = *(uint64_t const *)a ^ xor_mask, y = *(uint64_t const *)b ^ xor_mask;
+    return (x > y) - (x < y);
+}
+
+static int compar_xor_r(void const *a, void const *b, void *arg)
+{
+    uint64_t mask = *(uint64_t const *)arg;
+    uint64_t x = *(uint64_t const *)a ^ mask, y = *(uint64_t const *)b ^ mask;
+    return (x > y) - (x < y);
+}
+
+
+/* xorshift64*, the same as in bench */
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Parses a comma-separated list of numbers, returns how many there were. */
+static size_t parse_list(char const *s, size_t *list, size_t max)
+{
+    size_t n = 0;
+    char *p = (char *)s;
+
+    while (*p != '\0' && n < max) {
+        list[n++] = strtoul(p, &p, 10);
+        p += *p == ',';
+    }
+    return n;
+}
+
+
+/*
+Arrays of a run: the keys, the array sorted by the variant, the one sorted
+by the baseline, and a buffer of n elements
+*/
+struct arrays {
+    size_t n;
+    uint64_t *keys, *work, *base, *buf;
+    struct cpdqs_segment *segs;
+    size_t nsegs;
+};
+
+/* Which of the two sorts to run */
+enum side { VARIANT, BASELINE };
+
+static void run_radix_u64(struct arrays *a, enum side s)
+{
+    if (s == VARIANT) {
+        pdqsort_radix_u64(a->work, a->n);
+    } else {
+        sort_u64(a->base, a->n);
+    }
+}
+
+static void run_radix_u64_buf(struct arrays *a, enum side s)
+{
+    if (s == VARIANT) {
+        pdqsort_radix_u64_buf(a->work, a->n, a->buf);
+    } else {
+        sort_u64(a->base, a->n);
+    }
+}
+
+static void run_radix_i64(struct arrays *a, enum side s)
+{
+    if (s == VARIANT) {
+        pdqsort_radix_i64((int64_t *)a->work, a->n);
+    } else {
+        sort_i64((int64_t *)a->base, a->n);
+    }
+}
+
+static void run_radix_f64(struct arrays *a, enum side s)
+{
+    if (s == VARIANT) {
+        pdqsort_radix_f64((double *)a->work, a->n);
+    } else {
+        sort_f64((double *)a->base, a->n);
+    }
+}
+
+static void run_num_sort_u64(struct arrays *a, enum side s)
+{
+    if (s == VARIANT) {
+        num_sort_u64(a->work, a->n);
+    } else {
+        sort_u64(a->base, a->n);
+    }
+}
+
+static void run_pdqselect(struct arrays *a, enum side s)
+{
+    if (s == VARIANT) {
+        pdqselect(a->work, a->n, sizeof(uint64_t), compar_u64, a->n / 2);
+    } else {
+        pdqsort(a->base, a->n, sizeof(uint64_t), compar_u64);
+    }
+}
+
+static void run_pdqsort_partial(struct arrays *a, enum side s)
+{
+    if (s == VARIANT) {
+        pdqsort_partial(a->work, a->n, sizeof(uint64_t), compar_u64, a->n / 100 + 1);
+    } else {
+        pdqsort(a->base, a->n, sizeof(uint64_t), compar_u64);
+    }
+}
+
+static void run_pdqsort_many(struct arrays *a, enum side s)
+{
+    size_t i;
+    char *base = s == VARIANT ? (char *)a->work : (char *)a->base;
+
+    for (i = 0; i < a->nsegs; ++i) {
+        a->segs[i].base = base + ((char *)a->segs[i].base - (char *)a->keys);
+    }
+    if (s == VARIANT) {
+        pdqsort_many(a->segs, a->nsegs, sizeof(uint64_t), compar_u64);
+    } else {
+        for (i = 0; i < a->nsegs; ++i) {
+            pdqsort(a->segs[i].base, a->segs[i].nmemb, sizeof(uint64_t), compar_u64);
+        }
+    }
+    for (i = 0; i < a->nsegs; ++i) {
+        a->segs[i].base = (char *)a->keys + ((char *)a->segs[i].base - base);
+    }
+}
+
+static void run_pdqsort_r(struct arrays *a, enum side s)
+{
+    if (s == VARIANT) {
+        pdqsort_r(a->work, a->n, sizeof(uint64_t), compar_xor_r, &xor_mask);
+    } else {
+        pdqsort(a->base, a->n, sizeof(uint64_t), compar_xor);
+    }
+}
+
+/*
+Is the work array what the variant should leave: the same as the sorted
+baseline, or for pdqselect and pdqsort_partial, the same in the places they
+fix, and no smaller element after them?
+*/
+static int is_equal(struct arrays const *a)
+{
+    return memcmp(a->work, a->base, a->n * sizeof(uint64_t)) == 0;
+}
+
+static int is_selected(struct arrays const *a, size_t from, size_t to)
+{
+    size_t i;
+
+    for (i = from; i < to; ++i) {
+        if (a->work[i] != a->base[i]) {
+            return 0;
+        }
+    }
+    for (i = 0; i < a->n; ++i) {
+        if ((i < from && a->work[i] > a->base[from]) ||
+                (i >= to && a->work[i] < a->base[to - 1])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int check_pdqselect(struct arrays const *a)
+{
+    return is_selected(a, a->n / 2, a->n / 2 + 1);
+}
+
+static int check_pdqsort_partial(struct arrays const *a)
+{
+    return is_selected(a, 0, a->n / 100 + 1 < a->n ? a->n / 100 + 1 : a->n);
+}
+
+static struct {
+    char const *name;
+    char const *baseline;
+    void (*run)(struct arrays *, enum side);
+    int (*check)(struct arrays const *);
+} const variants[] = {
+    {"pdqsort_radix_u64", "sort_u64", run_radix_u64, is_equal},
+    {"pdqsort_radix_u64_buf", "sort_u64", run_radix_u64_buf, is_equal},
+    {"pdqsort_radix_i64", "sort_i64", run_radix_i64, is_equal},
+    {"pdqsort_radix_f64", "sort_f64", run_radix_f64, is_equal},
+    {"num_sort_u64", "sort_u64", run_num_sort_u64, is_equal},
+    {"pdqselect", "pdqsort", run_pdqselect, check_pdqselect},
+    {"pdqsort_partial", "pdqsort", run_pdqsort_partial, check_pdqsort_partial},
+    {"pdqsort_many", "pdqsort", run_pdqsort_many, is_equal},
+    {"pdqsort_r", "pdqsort", run_pdqsort_r, is_equal},
+};
+
+
+/* Fills the keys of the variant v, and cuts them into the arrays of pdqsort_many. */
+static void fill(struct arrays *a, size_t v)
+{
+    size_t i, len;
+    double d;
+
+    for (i = 0; i < a->n; ++i) {
+        a->keys[i] = rng();
+        if (variants[v].run == run_radix_f64) {
+            /* Doubles of both signs and many exponents, no NaN */
+            d = (double)(int64_t)a->keys[i] / (double)(1 + (rng() & 0xFFFFF));
+            memcpy(&a->keys[i], &d, sizeof(d));
+        }
+    }
+    xor_mask = rng();
+    a->nsegs = 0;
+    for (i = 0; i < a->n; i += len) {
+        len = 1 + rng() % (2 * MANY_LEN);
+        len = len < a->n - i ? len : a->n - i;
+        a->segs[a->nsegs].base = a->keys + i;
+        a->segs[a->nsegs].nmemb = len;
+        ++a->nsegs;
+    }
+}
+
+/* Runs one side on a copy of the keys, returns the fastest time. */
+static double measure(struct arrays *a, size_t v, enum side s)
+{
+    double start, best = -1;
+    size_t r;
+
+    for (r = 0; r < REPEATS; ++r) {
+        memcpy(s == VARIANT ? a->work : a->base, a->keys, a->n * sizeof(uint64_t));
+        start = now();
+        variants[v].run(a, s);
+        start = now() - start;
+        if (best < 0 || start < best) {
+            best = start;
+        }
+    }
+    return best;
+}
+
+
+int main(int argc, char **argv)
+{
+    size_t sizes[64] = {100, 10000, 1000000}, nsizes = 3;
+    size_t s, v;
+    int opt;
+    struct arrays a;
+    double variant, baseline;
+
+    while ((opt = getopt(argc, argv, "hn:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nsizes = parse_list(optarg, sizes, COUNT(sizes));
+            break;
+        default:
+            fprintf(opt == 'h' ? stdout : stderr, "usage: %s [-n sizes]\n", argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    printf("%-22s %-9s %10s %10s %10s\n", "algorithm", "baseline", "n", "ns/elem", "base ns");
+
+    for (s = 0; s < nsizes; ++s) {
+        a.n = sizes[s];
+        a.keys = malloc(a.n * sizeof(*a.keys));
+        a.work = malloc(a.n * sizeof(*a.work));
+        a.base = malloc(a.n * sizeof(*a.base));
+        a.buf = malloc(a.n * sizeof(*a.buf));
+        a.segs = malloc(a.n * sizeof(*a.segs));
+        if (a.n == 0 || a.keys == NULL || a.work == NULL || a.base == NULL ||
+                a.buf == NULL || a.segs == NULL) {
+            fprintf(stderr, "cannot sort %lu elements\n", (unsigned long)a.n);
+            return 1;
+        }
+
+        for (v = 0; v < COUNT(variants); ++v) {
+            fill(&a, v);
+            variant = measure(&a, v, VARIANT);
+            baseline = measure(&a, v, BASELINE);
+            if (!variants[v].check(&a)) {
+                fprintf(stderr, "%s: wrong result, n %lu\n",
+                    variants[v].name, (unsigned long)a.n);
+                return 1;
+            }
+            printf("%-22s %-9s %10lu %10.2f %10.2f\n",
+                variants[v].name, variants[v].baseline, (unsigned long)a.n,
+                variant * 1e9 / (double)a.n, baseline * 1e9 / (double)a.n);
+            fflush(stdout);
+        }
+
+        free(a.keys);
+        free(a.work);
+        free(a.base);
+        free(a.buf);
+        free(a.segs);
+    }
+    return 0;
+}
@@ -0,0 +1,421 @@
+/*
+    cpdqsort_external.h - External merge sort of the files of fixed-size records.
+
+    Copyright (c) 2023 Pawel Tarasiuk
+
+    This software is provided 'as-is', without any express or implied warranty.
+    In no event will the authors be held liable for any damages arising from
+    the use of this software.
+
+    Permission is granted to anyone to use this software for any purpose,
+    including commercial applications, and to alter it and redistribute it
+    freely, subject to the following restrictions:
+
+    1. The origin of this software must not be misrepresented; you must not
+       claim that you wrote the original software. If you use this software
+       in a product, an acknowledgment in the product documentation would be
+       appreciated but is not required.
+
+    2. Altered source versions must be plainly marked as such, and must not
+       be misrepresented as being the original software.
+
+    3. This notice may not be removed or altered from any source distribution.
+*/
+
+#ifndef __CPDQSORT_EXTERNAL_H__
+#define __CPDQSORT_EXTERNAL_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cpdqsort_parallel.h"
+
+/* pread, pwrite and mkstemp are declared only if the build asks for them. */
+#if !(defined(_POSIX_VERSION) && _POSIX_VERSION >= 200809L) && \
+    !(defined(_XOPEN_VERSION) && _XOPEN_VERSION >= 600)
+#error "cpdqsort_external.h needs POSIX.1-2008: define _POSIX_C_SOURCE as 200809L before including any header"
+#endif
+
+/*
+The offsets in the files are off_t, which is 32-bit on some 32-bit systems
+unless the build asks for -D_FILE_OFFSET_BITS=64; the files of 2 GiB or more
+would overflow it. The array size goes negative, failing the build, if so.
+*/
+typedef char CPDQS_V(ext_off_t_needs_FILE_OFFSET_BITS_64)[sizeof(off_t) >= 8 ? 1 : -1];
+
+
+/* Memory budget in bytes of an external sort, unless the options give one. */
+#ifndef CPDQS_EXT_MEMORY
+#define CPDQS_EXT_MEMORY ((size_t)256 << 20)
+#endif
+
+/*
+The smallest buffer in bytes a run gets in a merge. A merge takes as many
+runs as fit in the memory budget with buffers this large, more runs are
+merged in several passes.
+*/
+#ifndef CPDQS_EXT_BLOCK
+#define CPDQS_EXT_BLOCK ((size_t)1 << 20)
+#endif
+
+
+/* Options of pdqsort_file; zero or NULL fields take the defaults. */
+struct CPDQS_V(ext_options) {
+    size_t memory;          /* Memory budget in bytes, CPDQS_EXT_MEMORY by default. */
+    char const *tmpdir;     /* Directory of the runs, $TMPDIR or /tmp by default. */
+    unsigned int nthreads;  /* Threads sorting a chunk, one per CPU by default. */
+};
+
+/* Sorted run, the bytes [begin, end) of a temporary file */
+struct CPDQS_V(ext_run) {
+    off_t begin, end;
+};
+
+/* Run being merged, read a buffer at a time */
+struct CPDQS_V(ext_leaf) {
+    char *buf;
+    off_t pos, stop;
+};
+
+/*
+Merge of the runs of a temporary file through the loser tree of
+pdqsort_merge, whose inputs are the buffers of the runs
+*/
+struct CPDQS_V(ext_merge) {
+    struct CPDQS_V(merge) in;
+    size_t block;
+    struct CPDQS_V(ext_leaf) *leaves;
+};
+
+
+/* Reads up to len bytes from fd, fewer only at the end of the file. */
+CPDQS_FN ssize_t CPDQS_V(ext_read)(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+/* Reads exactly len bytes at the offset of fd. */
+CPDQS_FN int CPDQS_V(ext_pread)(int fd, void *buf, size_t len, off_t off) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = pread(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        buf = (char *)buf + n;
+        len -= (size_t)n;
+        off += n;
+    }
+    return 0;
+}
+
+/* Writes exactly len bytes at the offset of fd. */
+CPDQS_FN int CPDQS_V(ext_pwrite)(int fd, void const *buf, size_t len, off_t off) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        buf = (char const *)buf + n;
+        len -= (size_t)n;
+        off += n;
+    }
+    return 0;
+}
+
+/*
+Opens a new temporary file in tmpdir, and unlinks it right away so that it
+goes away with the descriptor. Returns -1 on error.
+*/
+CPDQS_FN int CPDQS_V(ext_tmpfile)(char const *tmpdir) {
+    static char const name[] = "/cpdqsort.XXXXXX";
+    char *path;
+    int fd, err;
+
+    if (tmpdir == NULL) {
+        tmpdir = getenv("TMPDIR");
+    }
+    if (tmpdir == NULL || *tmpdir == '\0') {
+        tmpdir = "/tmp";
+    }
+    path = malloc(strlen(tmpdir) + sizeof(name));
+    if (path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    strcpy(path, tmpdir);
+    strcat(path, name);
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        err = errno;
+        unlink(path);
+        errno = err;
+    }
+    free(path);
+    return fd;
+}
+
+
+/* Fills the buffer of the run i, or leaves it empty at the end of the run. */
+CPDQS_FN int CPDQS_V(ext_refill)(struct CPDQS_V(ext_merge) *m, size_t i, int fd) {
+    struct CPDQS_V(ext_leaf) *leaf = &m->leaves[i];
+    size_t len = m->block;
+
+    if (leaf->stop - leaf->pos < (off_t)len) {
+        len = (size_t)(leaf->stop - leaf->pos);
+    }
+    if (len == 0) {
+        m->in.cur[i] = m->in.end[i] = leaf->buf;
+        return 0;
+    }
+    if (CPDQS_V(ext_pread)(fd, leaf->buf, len, leaf->pos) != 0) {
+        return -1;
+    }
+    m->in.cur[i] = leaf->buf;
+    m->in.end[i] = leaf->buf + len;
+    leaf->pos += (off_t)len;
+    return 0;
+}
+
+/*
+Merges the k runs of in_fd into a single run written to out_fd at out_off,
+through mem of memsize bytes: one buffer for each of the runs and one for
+the output. Returns the end of the written run, or -1 on error.
+*/
+CPDQS_FN off_t CPDQS_V(ext_merge_runs)(
+        int in_fd, struct CPDQS_V(ext_run) const *runs, size_t k,
+        int out_fd, off_t out_off, char *mem, size_t memsize,
+        size_t size, int (* compar)(void const *, void const *)) {
+    struct CPDQS_V(ext_merge) m;
+    char *out, *out_cur, *out_end;
+    size_t i, w;
+    off_t result = -1;
+
+    m.block = memsize / (k + 1) / size * size;
+    m.leaves = malloc(k * sizeof(*m.leaves));
+    if (!CPDQS_V(merge_init)(&m.in, k, compar) || m.leaves == NULL) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < k; ++i) {
+        m.leaves[i].buf = mem + i * m.block;
+        m.leaves[i].pos = runs[i].begin;
+        m.leaves[i].stop = runs[i].end;
+        if (CPDQS_V(ext_refill)(&m, i, in_fd) != 0) {
+            goto out;
+        }
+    }
+    CPDQS_V(merge_build)(&m.in);
+
+    out = out_cur = mem + k * m.block;
+    out_end = out + m.block;
+    for (w = m.in.tree[0]; m.in.cur[w] != m.in.end[w]; w = m.in.tree[0]) {
+        memcpy(out_cur, m.in.cur[w], size);
+        out_cur += size;
+        if (out_cur == out_end) {
+            if (CPDQS_V(ext_pwrite)(out_fd, out, m.block, out_off) != 0) {
+                goto out;
+            }
+            out_off += (off_t)m.block;
+            out_cur = out;
+        }
+        m.in.cur[w] += size;
+        if (m.in.cur[w] == m.in.end[w] && CPDQS_V(ext_refill)(&m, w, in_fd) != 0) {
+            goto out;
+        }
+        CPDQS_V(merge_play)(&m.in, w);
+    }
+    if (CPDQS_V(ext_pwrite)(out_fd, out, (size_t)(out_cur - out), out_off) != 0) {
+        goto out;
+    }
+    result = out_off + (out_cur - out);
+
+out:
+    free(m.in.tree);
+    free(m.leaves);
+    return result;
+}
+
+
+/*
+Sorts the records of size bytes in the file in_path into out_path, which
+may be the same file. Returns 0 on success, or -1 with errno set.
+*/
+CPDQS_FN int CPDQS_V(ext_sort)(
+        char const *in_path, char const *out_path, size_t size,
+        int (* compar)(void const *, void const *), int branchless,
+        struct CPDQS_V(ext_options) const *options) {
+    size_t memory = CPDQS_EXT_MEMORY, chunk, len = 0, fan_in, nruns = 0, cap = 0, i, n;
+    char const *tmpdir = NULL;
+    unsigned int nthreads = 0;
+    struct CPDQS_V(ext_run) *runs = NULL, *next;
+    char *mem = NULL;
+    int in_fd = -1, out_fd = -1, run_fd = -1, pass_fd = -1, result = -1, err;
+    off_t off = 0, begin;
+    ssize_t got;
+
+    if (options != NULL) {
+        memory = options->memory != 0 ? options->memory : memory;
+        tmpdir = options->tmpdir;
+        nthreads = options->nthreads;
+    }
+    if (size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (memory / size < 3) {
+        memory = 3 * size;
+    }
+    chunk = memory / size * size;
+    fan_in = memory / CPDQS_EXT_BLOCK > 3 ? memory / CPDQS_EXT_BLOCK - 1 : 2;
+    if (fan_in > memory / size - 1) {
+        fan_in = memory / size - 1;
+    }
+
+    mem = malloc(chunk);
+    if (mem == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    in_fd = open(in_path, O_RDONLY);
+    if (in_fd < 0) {
+        goto out;
+    }
+
+    /* Sorted runs of a chunk each */
+    while ((got = CPDQS_V(ext_read)(in_fd, mem, chunk)) != 0) {
+        if (got < 0) {
+            goto out;
+        }
+        len = (size_t)got;
+        if (len % size != 0) {
+            errno = EINVAL;
+            goto out;
+        }
+        CPDQS_V(par_pdqsort)(mem, len / size, size, compar, branchless, nthreads);
+        if (nruns == 0 && len < chunk) {
+            /* The whole input fits in the memory, no runs needed. */
+            break;
+        }
+        if (run_fd < 0 && (run_fd = CPDQS_V(ext_tmpfile)(tmpdir)) < 0) {
+            goto out;
+        }
+        if (nruns == cap) {
+            cap = cap != 0 ? 2 * cap : 16;
+            next = realloc(runs, cap * sizeof(*runs));
+            if (next == NULL) {
+                errno = ENOMEM;
+                goto out;
+            }
+            runs = next;
+        }
+        if (CPDQS_V(ext_pwrite)(run_fd, mem, len, off) != 0) {
+            goto out;
+        }
+        runs[nruns].begin = off;
+        off += (off_t)len;
+        runs[nruns].end = off;
+        ++nruns;
+        if (len < chunk) {
+            break;
+        }
+    }
+    close(in_fd);
+    in_fd = -1;
+
+    /* Intermediate passes until a single merge takes all the runs */
+    while (nruns > fan_in) {
+        if ((pass_fd = CPDQS_V(ext_tmpfile)(tmpdir)) < 0) {
+            goto out;
+        }
+        off = 0;
+        for (i = 0; i * fan_in < nruns; ++i) {
+            n = nruns - i * fan_in < fan_in ? nruns - i * fan_in : fan_in;
+            begin = off;
+            off = CPDQS_V(ext_merge_runs)(
+                run_fd, runs + i * fan_in, n, pass_fd, off, mem, chunk, size, compar);
+            if (off < 0) {
+                goto out;
+            }
+            /* The runs up to i * fan_in are merged already. */
+            runs[i].begin = begin;
+            runs[i].end = off;
+        }
+        nruns = i;
+        close(run_fd);
+        run_fd = pass_fd;
+        pass_fd = -1;
+    }
+
+    out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0) {
+        goto out;
+    }
+    if (nruns == 0) {
+        result = CPDQS_V(ext_pwrite)(out_fd, mem, len, 0);
+    } else {
+        result = CPDQS_V(ext_merge_runs)(
+            run_fd, runs, nruns, out_fd, 0, mem, chunk, size, compar) < 0 ? -1 : 0;
+    }
+    if (close(out_fd) != 0) {
+        result = -1;
+    }
+    out_fd = -1;
+
+out:
+    err = errno;
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (run_fd >= 0) {
+        close(run_fd);
+    }
+    if (pass_fd >= 0) {
+        close(pass_fd);
+    }
+    free(runs);
+    free(mem);
+    errno = err;
+    return result;
+}
+
+
+/* Let's pretend it's a function, the way the others do */
+#define pdqsort_file(in_path, out_path, _size, _compar, options) \
+    CPDQS_V(ext_sort)((in_path), (out_path), (_size), (_compar), CPDQS_BRANCHLESS, (options))
+
+#define pdqsort_file_branchless(in_path, out_path, _size, _compar, options) \
+    CPDQS_V(ext_sort)((in_path), (out_path), (_size), (_compar), 1, (options))
+
+
+#endif  /* __CPDQSORT_EXTERNAL_H__ */
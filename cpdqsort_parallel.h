@@ -0,0 +1,990 @@
+/*
+    cpdqsort_parallel.h - Parallel pattern-defeating quicksort on POSIX threads.
+
+    Copyright (c) 2023 Pawel Tarasiuk
+
+    This software is provided 'as-is', without any express or implied warranty.
+    In no event will the authors be held liable for any damages arising from
+    the use of this software.
+
+    Permission is granted to anyone to use this software for any purpose,
+    including commercial applications, and to alter it and redistribute it
+    freely, subject to the following restrictions:
+
+    1. The origin of this software must not be misrepresented; you must not
+       claim that you wrote the original software. If you use this software
+       in a product, an acknowledgment in the product documentation would be
+       appreciated but is not required.
+
+    2. Altered source versions must be plainly marked as such, and must not
+       be misrepresented as being the original software.
+
+    3. This notice may not be removed or altered from any source distribution.
+*/
+
+#ifndef __CPDQSORT_PARALLEL_H__
+#define __CPDQSORT_PARALLEL_H__
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cpdqsort.h"
+
+
+/* Ranges at least this long are shared with the other threads. */
+#ifndef CPDQS_PAR_GRAIN
+#define CPDQS_PAR_GRAIN 16384
+#endif
+
+/*
+Ranges at least this long, and longer than a fair share of a single thread,
+are partitioned by all the threads together.
+*/
+#ifndef CPDQS_PAR_SPLIT_MIN
+#define CPDQS_PAR_SPLIT_MIN 1048576
+#endif
+
+/* Upper limit for the number of threads. */
+#define CPDQS_PAR_MAX_THREADS 256
+
+/* Number of the segments of a batch a thread takes at once. */
+#ifndef CPDQS_PAR_MANY_GRAIN
+#define CPDQS_PAR_MANY_GRAIN 64
+#endif
+
+
+/*
+Declares the sorting context of a thread of the job. The statistics are not
+collected across the threads, each context counts into its own sink.
+*/
+#define CPDQS_PAR_CONTEXT(job) \
+        CPDQS_STATS_DECL(NULL) \
+        size_t CPDQS_V(size) = (job)->size; \
+        CPDQS_COMPAR_DECL((job)->compar, NULL, NULL, 0); \
+        int CPDQS_V(branchless) = (job)->branchless; \
+        int CPDQS_V(keys) = CPDQS_KEYS_ANY
+
+
+/* Deque of ranges - the owner works at the bottom, the thieves at the top. */
+struct CPDQS_V(par_deque) {
+    pthread_mutex_t lock;
+    struct CPDQS_V(frame) *tasks;
+    size_t top, bottom, cap;
+};
+
+struct CPDQS_V(par_job) {
+    size_t size;
+    int (* compar)(void const *, void const *);
+    int branchless;
+    unsigned int nthreads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int started;
+    unsigned int barrier_waiting, barrier_phase;
+
+    /* Ranges in the deques or being sorted, and ever shared, guarded by lock */
+    size_t pending, shared;
+    pthread_cond_t work;
+    struct CPDQS_V(par_deque) *deques;
+    size_t grain;
+
+    /* Ranges waiting to be partitioned by all the threads */
+    struct CPDQS_V(par_deque) splits;
+    size_t split_min;
+
+    /* Range being partitioned by all the threads, pivot at its beginning */
+    struct CPDQS_V(frame) cur;
+    size_t cur_len;
+    int cur_active, cur_left_eq;
+    size_t *counts;
+    unsigned int next_seed;
+};
+
+struct CPDQS_V(par_thread) {
+    struct CPDQS_V(par_job) *job;
+    unsigned int id;
+    pthread_t thread;
+};
+
+
+/* Pushes the task at the bottom of the deque. Returns 0 if out of memory. */
+CPDQS_FN int CPDQS_V(par_deque_push)(
+        struct CPDQS_V(par_deque) *deque, struct CPDQS_V(frame) const *task) {
+    struct CPDQS_V(frame) *tasks;
+    int ok = 1;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->cap) {
+        if (deque->top > 0) {
+            memmove(deque->tasks, deque->tasks + deque->top,
+                (deque->bottom - deque->top) * sizeof(struct CPDQS_V(frame)));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        } else {
+            tasks = realloc(deque->tasks,
+                (2 * deque->cap + 16) * sizeof(struct CPDQS_V(frame)));
+            if (tasks == NULL) {
+                ok = 0;
+            } else {
+                deque->tasks = tasks;
+                deque->cap = 2 * deque->cap + 16;
+            }
+        }
+    }
+    if (ok) {
+        deque->tasks[deque->bottom++] = *task;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return ok;
+}
+
+/* Pops a task from the bottom (LIFO) or the top (FIFO) of the deque. */
+CPDQS_FN int CPDQS_V(par_deque_pop)(
+        struct CPDQS_V(par_deque) *deque, struct CPDQS_V(frame) *task, int from_top) {
+    int ok = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top < deque->bottom) {
+        *task = from_top ? deque->tasks[deque->top++] : deque->tasks[--deque->bottom];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return ok;
+}
+
+
+/* Makes the task available to all the threads. Returns 0 if out of memory. */
+CPDQS_FN int CPDQS_V(par_share)(
+        struct CPDQS_V(par_job) *job, unsigned int id, struct CPDQS_V(frame) const *task) {
+    pthread_mutex_lock(&job->lock);
+    ++job->pending;
+    pthread_mutex_unlock(&job->lock);
+
+    if (CPDQS_V(par_deque_push)(&job->deques[id], task)) {
+        pthread_mutex_lock(&job->lock);
+        ++job->shared;
+        pthread_cond_signal(&job->work);
+        pthread_mutex_unlock(&job->lock);
+        return 1;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    --job->pending;
+    pthread_mutex_unlock(&job->lock);
+    return 0;
+}
+
+/* Waits until all the threads of the job get here. */
+CPDQS_FN void CPDQS_V(par_barrier)(struct CPDQS_V(par_job) *job) {
+    unsigned int phase;
+
+    pthread_mutex_lock(&job->lock);
+    phase = job->barrier_phase;
+    if (++job->barrier_waiting == job->nthreads) {
+        job->barrier_waiting = 0;
+        ++job->barrier_phase;
+        pthread_cond_broadcast(&job->cond);
+    } else {
+        while (phase == job->barrier_phase) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+
+/* Range of the elements after the pivot that thread id partitions. */
+#define CPDQS_PAR_CHUNK(job, id) \
+    (1 + ((job)->cur_len - 1) * (id) / (job)->nthreads)
+
+/* Is the element *p going to the left of the pivot? */
+#define CPDQS_PAR_IS_LEFT(p) (CPDQS_V(left_eq) ? \
+    !CPDQS_LT(CPDQS_V(pbegin), (p)) : CPDQS_LT((p), CPDQS_V(pbegin)))
+
+/* Partitions the chunk of the current range, returns the left part length. */
+CPDQS_FN size_t CPDQS_V(par_partition_chunk)(struct CPDQS_V(par_job) *job, unsigned int id) {
+    CPDQS_PAR_CONTEXT(job);
+    char *CPDQS_V(pbegin) = job->cur.begin;
+    int CPDQS_V(left_eq) = job->cur_left_eq;
+    char *CPDQS_V(cb) = CPDQS_SFT(CPDQS_V(pbegin), CPDQS_PAR_CHUNK(job, id));
+    char *CPDQS_V(first) = CPDQS_V(cb);
+    char *CPDQS_V(last) = CPDQS_SFT(CPDQS_V(pbegin), CPDQS_PAR_CHUNK(job, id + 1));
+
+    (void)CPDQS_V(branchless);
+    (void)CPDQS_V(keys);
+    while (1) {
+        while (CPDQS_V(first) < CPDQS_V(last) && CPDQS_PAR_IS_LEFT(CPDQS_V(first))) {
+            CPDQS_V(first) += CPDQS_V(size);
+        }
+        while (CPDQS_V(first) < CPDQS_V(last) &&
+                !CPDQS_PAR_IS_LEFT(CPDQS_V(last) - CPDQS_V(size))) {
+            CPDQS_V(last) -= CPDQS_V(size);
+        }
+        if (CPDQS_V(first) >= CPDQS_V(last)) {
+            break;
+        }
+        CPDQS_V(last) -= CPDQS_V(size);
+        CPDQS_SW(CPDQS_V(first), CPDQS_V(last));
+        CPDQS_V(first) += CPDQS_V(size);
+    }
+    return CPDQS_LEN(CPDQS_V(cb), CPDQS_V(first));
+}
+
+/*
+Interval of the elements of chunk c that are on the wrong side of the split
+point m - the right part of the chunk before m (side 0), or the left part
+of the chunk after m (side 1). Indices are relative to the pivot.
+*/
+CPDQS_FN size_t CPDQS_V(par_misplaced)(
+        struct CPDQS_V(par_job) *job, unsigned int c, int side, size_t m, size_t *lo) {
+    size_t cb = CPDQS_PAR_CHUNK(job, c), ce = CPDQS_PAR_CHUNK(job, c + 1);
+    size_t cm = cb + job->counts[c];
+    size_t hi;
+
+    if (side == 0) {
+        *lo = cm;
+        hi = ce < m ? ce : m;
+    } else {
+        *lo = cb > m ? cb : m;
+        hi = cm;
+    }
+    return hi > *lo ? hi - *lo : 0;
+}
+
+/* Moves the element k of the misplaced ones on the given side to (c, lo, len). */
+CPDQS_FN void CPDQS_V(par_seek)(
+        struct CPDQS_V(par_job) *job, int side, size_t m, size_t k,
+        unsigned int *c, size_t *lo, size_t *len) {
+    for (*c = 0; *c < job->nthreads; ++*c) {
+        *len = CPDQS_V(par_misplaced)(job, *c, side, m, lo);
+        if (k < *len) {
+            *lo += k;
+            *len -= k;
+            return;
+        }
+        k -= *len;
+    }
+}
+
+/* Swaps the share of thread id of the misplaced elements across the split. */
+CPDQS_FN void CPDQS_V(par_swap_misplaced)(struct CPDQS_V(par_job) *job, unsigned int id) {
+    CPDQS_PAR_CONTEXT(job);
+    char *CPDQS_V(pbegin) = job->cur.begin;
+    size_t CPDQS_V(m) = 1, CPDQS_V(k) = 0, CPDQS_V(from), CPDQS_V(to);
+    unsigned int CPDQS_V(c)[2];
+    size_t CPDQS_V(lo)[2], CPDQS_V(len)[2];
+    unsigned int CPDQS_V(t);
+    int CPDQS_V(side);
+
+    (void)CPDQS_V(compar);
+    (void)CPDQS_V(compar_r);
+    (void)CPDQS_V(arg);
+    (void)CPDQS_V(with_arg);
+    (void)CPDQS_V(branchless);
+    (void)CPDQS_V(keys);
+    for (CPDQS_V(t) = 0; CPDQS_V(t) < job->nthreads; ++CPDQS_V(t)) {
+        CPDQS_V(m) += job->counts[CPDQS_V(t)];
+    }
+    for (CPDQS_V(t) = 0; CPDQS_V(t) < job->nthreads; ++CPDQS_V(t)) {
+        CPDQS_V(k) += CPDQS_V(par_misplaced)(job, CPDQS_V(t), 0, CPDQS_V(m), &CPDQS_V(from));
+    }
+    CPDQS_V(from) = CPDQS_V(k) * id / job->nthreads;
+    CPDQS_V(to) = CPDQS_V(k) * (id + 1) / job->nthreads;
+    if (CPDQS_V(from) == CPDQS_V(to)) {
+        return;
+    }
+
+    for (CPDQS_V(side) = 0; CPDQS_V(side) < 2; ++CPDQS_V(side)) {
+        CPDQS_V(par_seek)(job, CPDQS_V(side), CPDQS_V(m), CPDQS_V(from),
+            &CPDQS_V(c)[CPDQS_V(side)], &CPDQS_V(lo)[CPDQS_V(side)],
+            &CPDQS_V(len)[CPDQS_V(side)]);
+    }
+    for (CPDQS_V(k) = CPDQS_V(from); CPDQS_V(k) < CPDQS_V(to); ++CPDQS_V(k)) {
+        for (CPDQS_V(side) = 0; CPDQS_V(side) < 2; ++CPDQS_V(side)) {
+            while (CPDQS_V(len)[CPDQS_V(side)] == 0) {
+                CPDQS_V(len)[CPDQS_V(side)] = CPDQS_V(par_misplaced)(
+                    job, ++CPDQS_V(c)[CPDQS_V(side)], CPDQS_V(side), CPDQS_V(m),
+                    &CPDQS_V(lo)[CPDQS_V(side)]);
+            }
+        }
+        CPDQS_SW(
+            CPDQS_SFT(CPDQS_V(pbegin), CPDQS_V(lo)[0]),
+            CPDQS_SFT(CPDQS_V(pbegin), CPDQS_V(lo)[1]));
+        for (CPDQS_V(side) = 0; CPDQS_V(side) < 2; ++CPDQS_V(side)) {
+            ++CPDQS_V(lo)[CPDQS_V(side)];
+            --CPDQS_V(len)[CPDQS_V(side)];
+        }
+    }
+}
+
+
+/*
+Sorts the range on its own, with the bad partitions left to it and the
+leftmost flag it was split off with.
+*/
+CPDQS_FN void CPDQS_V(par_sort_task)(
+        struct CPDQS_V(par_job) *job, struct CPDQS_V(frame) const *task) {
+    CPDQS_PAR_CONTEXT(job);
+    CPDQS_TMP_DECL(NULL);
+    struct CPDQS_V(frame) CPDQS_V(stack)[CPDQS_STACK_DEPTH];
+    size_t CPDQS_V(depth) = 0;
+    CPDQS_PDQS_DECL;
+
+    CPDQS_PDQS_PUSH(task->begin, task->end, task->bad_allowed, task->is_leftmost);
+    while (CPDQS_V(depth) > 0) {
+        CPDQS_PDQS_POP;
+        CPDQS_PDQSLOOP(CPDQS_PDQS_PUSH);
+    }
+    CPDQS_TMP_END;
+}
+
+/* Hands the range over to the next phase - another split or the deques. */
+CPDQS_FN void CPDQS_V(par_schedule)(
+        struct CPDQS_V(par_job) *job, struct CPDQS_V(frame) const *task, int may_split) {
+    size_t len = (size_t)(task->end - task->begin) / job->size;
+
+    if (may_split && len >= job->split_min && CPDQS_V(par_deque_push)(&job->splits, task)) {
+        return;
+    }
+    if (!CPDQS_V(par_share)(job, job->next_seed, task)) {
+        /* Out of memory - the thread 0 sorts it on its own. */
+        CPDQS_V(par_sort_task)(job, task);
+        return;
+    }
+    job->next_seed = (job->next_seed + 1) % job->nthreads;
+}
+
+/* Picks the next range to be partitioned by all the threads. Thread 0 only. */
+CPDQS_FN void CPDQS_V(par_next_split)(struct CPDQS_V(par_job) *job) {
+    CPDQS_PAR_CONTEXT(job);
+
+    (void)CPDQS_V(branchless);
+    (void)CPDQS_V(keys);
+    job->cur_active = CPDQS_V(par_deque_pop)(&job->splits, &job->cur, 1);
+    if (job->cur_active) {
+        job->cur_len = CPDQS_LEN(job->cur.begin, job->cur.end);
+        CPDQS_CHPIV(job->cur.begin, job->cur.end, job->cur_len);
+        job->cur_left_eq = !job->cur.is_leftmost &&
+            !CPDQS_LT(CPDQS_SFT(job->cur.begin, -1), job->cur.begin);
+    }
+}
+
+/*
+Puts the pivot in place and schedules both sides, shuffling them first if
+they are highly unbalanced, like the pdqsort loop does. Thread 0 only.
+*/
+CPDQS_FN void CPDQS_V(par_finish_split)(struct CPDQS_V(par_job) *job) {
+    size_t CPDQS_V(size) = job->size;
+    CPDQS_STATS_DECL(NULL)
+    size_t tlen = job->cur_len;
+    size_t CPDQS_V(l_size) = 0, CPDQS_V(r_size);
+    char *CPDQS_V(begin) = job->cur.begin, *CPDQS_V(end) = job->cur.end;
+    struct CPDQS_V(frame) left, right;
+    char *CPDQS_V(pivot_pos);
+    unsigned int t;
+    int balanced;
+
+    for (t = 0; t < job->nthreads; ++t) {
+        CPDQS_V(l_size) += job->counts[t];
+    }
+    CPDQS_V(r_size) = tlen - CPDQS_V(l_size) - 1;
+    CPDQS_V(pivot_pos) = CPDQS_SFT(CPDQS_V(begin), CPDQS_V(l_size));
+    CPDQS_SW(CPDQS_V(begin), CPDQS_V(pivot_pos));
+
+    right.begin = CPDQS_SFT(CPDQS_V(pivot_pos), 1);
+    right.end = CPDQS_V(end);
+    right.bad_allowed = job->cur.bad_allowed;
+    right.is_leftmost = 0;
+
+    if (job->cur_left_eq) {
+        /* The left side is all equal to the pivot. */
+        CPDQS_V(par_schedule)(job, &right, 1);
+        return;
+    }
+
+    left.begin = CPDQS_V(begin);
+    left.end = CPDQS_V(pivot_pos);
+    left.bad_allowed = job->cur.bad_allowed;
+    left.is_leftmost = job->cur.is_leftmost;
+
+    /*
+    The unbalanced sides are sorted by one thread each. The last bad
+    partition allowed is left to their own pdqsort, which falls back to
+    heapsort on it.
+    */
+    balanced = CPDQS_V(l_size) >= tlen / CPDQS_UNBALANCED_DIV &&
+        CPDQS_V(r_size) >= tlen / CPDQS_UNBALANCED_DIV;
+    if (!balanced) {
+        CPDQS_STAT(unbalanced);
+        if (left.bad_allowed > 1) {
+            --left.bad_allowed;
+            --right.bad_allowed;
+        }
+        CPDQS_BRKPAT;
+    }
+    CPDQS_V(par_schedule)(job, &left, balanced);
+    CPDQS_V(par_schedule)(job, &right, balanced);
+}
+
+/* Partitions the ranges too long for a single thread, with all the threads. */
+CPDQS_FN void CPDQS_V(par_split_phase)(struct CPDQS_V(par_thread) *self) {
+    struct CPDQS_V(par_job) *job = self->job;
+
+    while (1) {
+        if (self->id == 0) {
+            CPDQS_V(par_next_split)(job);
+        }
+        CPDQS_V(par_barrier)(job);
+        if (!job->cur_active) {
+            break;
+        }
+        job->counts[self->id] = CPDQS_V(par_partition_chunk)(job, self->id);
+        CPDQS_V(par_barrier)(job);
+        CPDQS_V(par_swap_misplaced)(job, self->id);
+        CPDQS_V(par_barrier)(job);
+        if (self->id == 0) {
+            CPDQS_V(par_finish_split)(job);
+        }
+    }
+}
+
+
+/* Shares long ranges through the deque of the thread, keeps the rest. */
+#define CPDQS_PAR_PUSH(b, e, bad, leftmost) { \
+        struct CPDQS_V(frame) CPDQS_V(task); \
+        CPDQS_V(task).begin = (b); \
+        CPDQS_V(task).end = (e); \
+        CPDQS_V(task).bad_allowed = (bad); \
+        CPDQS_V(task).is_leftmost = (leftmost); \
+        if ( \
+                (size_t)CPDQS_LEN(CPDQS_V(task).begin, CPDQS_V(task).end) < job->grain || \
+                !CPDQS_V(par_share)(job, self->id, &CPDQS_V(task))) { \
+            CPDQS_PDQS_PUSH( \
+                CPDQS_V(task).begin, CPDQS_V(task).end, \
+                CPDQS_V(task).bad_allowed, CPDQS_V(task).is_leftmost); \
+        } \
+    }
+
+/* Sorts the ranges from the own deque, or stolen from the others. */
+CPDQS_FN void CPDQS_V(par_steal_phase)(struct CPDQS_V(par_thread) *self) {
+    struct CPDQS_V(par_job) *job = self->job;
+    CPDQS_PAR_CONTEXT(job);
+    CPDQS_TMP_DECL(NULL);
+    struct CPDQS_V(frame) CPDQS_V(stack)[CPDQS_STACK_DEPTH];
+    size_t CPDQS_V(depth);
+    struct CPDQS_V(frame) CPDQS_V(next);
+    unsigned int CPDQS_V(victim);
+    size_t CPDQS_V(seen);
+    int CPDQS_V(found), CPDQS_V(done);
+    CPDQS_PDQS_DECL;
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        CPDQS_V(seen) = job->shared;
+        pthread_mutex_unlock(&job->lock);
+
+        CPDQS_V(found) = CPDQS_V(par_deque_pop)(&job->deques[self->id], &CPDQS_V(next), 0);
+        for (CPDQS_V(victim) = 1;
+                !CPDQS_V(found) && CPDQS_V(victim) < job->nthreads; ++CPDQS_V(victim)) {
+            CPDQS_V(found) = CPDQS_V(par_deque_pop)(
+                &job->deques[(self->id + CPDQS_V(victim)) % job->nthreads],
+                &CPDQS_V(next), 1);
+        }
+        if (!CPDQS_V(found)) {
+            /* Sleep until a range is shared, or the last one is sorted. */
+            pthread_mutex_lock(&job->lock);
+            while (job->pending > 0 && job->shared == CPDQS_V(seen)) {
+                pthread_cond_wait(&job->work, &job->lock);
+            }
+            CPDQS_V(done) = job->pending == 0;
+            pthread_mutex_unlock(&job->lock);
+            if (CPDQS_V(done)) {
+                break;
+            }
+            continue;
+        }
+
+        CPDQS_V(depth) = 0;
+        CPDQS_PDQS_PUSH(
+            CPDQS_V(next).begin, CPDQS_V(next).end,
+            CPDQS_V(next).bad_allowed, CPDQS_V(next).is_leftmost);
+        while (CPDQS_V(depth) > 0) {
+            CPDQS_PDQS_POP;
+            CPDQS_PDQSLOOP(CPDQS_PAR_PUSH);
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (--job->pending == 0) {
+            pthread_cond_broadcast(&job->work);
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+    CPDQS_TMP_END;
+}
+
+
+CPDQS_FN void *CPDQS_V(par_thread_main)(void *arg) {
+    struct CPDQS_V(par_thread) *self = arg;
+    struct CPDQS_V(par_job) *job = self->job;
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->started) {
+        pthread_cond_wait(&job->cond, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    CPDQS_V(par_split_phase)(self);
+    CPDQS_V(par_steal_phase)(self);
+    return NULL;
+}
+
+
+/* Number of the online processors, or 1 if unknown. */
+CPDQS_FN unsigned int CPDQS_V(par_ncpus)(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+
+/* pdqsort with all the parameters, on nthreads threads (0 - one per CPU). */
+CPDQS_FN void CPDQS_V(par_pdqsort)(
+        void *base, size_t nmemb, size_t size,
+        int (* compar)(void const *, void const *), int branchless, unsigned int nthreads) {
+    struct CPDQS_V(par_job) job;
+    struct CPDQS_V(par_thread) *threads = NULL;
+    struct CPDQS_V(frame) top;
+    unsigned int t, created;
+
+    if (nthreads == 0) {
+        nthreads = CPDQS_V(par_ncpus)();
+    }
+    if (nthreads > CPDQS_PAR_MAX_THREADS) {
+        nthreads = CPDQS_PAR_MAX_THREADS;
+    }
+    if (nthreads > 1 && nmemb >= 2 * CPDQS_PAR_GRAIN) {
+        threads = malloc(nthreads * sizeof(*threads));
+    }
+    if (threads == NULL) {
+        CPDQS_PDQSORT(base, nmemb, size, compar, branchless, NULL, NULL);
+        return;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.size = size;
+    job.compar = compar;
+    job.branchless = branchless;
+    job.grain = CPDQS_PAR_GRAIN;
+    job.split_min = nmemb / nthreads + 1;
+    if (job.split_min < CPDQS_PAR_SPLIT_MIN) {
+        job.split_min = CPDQS_PAR_SPLIT_MIN;
+    }
+    job.deques = calloc(nthreads, sizeof(*job.deques));
+    job.counts = calloc(nthreads, sizeof(*job.counts));
+    if (job.deques == NULL || job.counts == NULL) {
+        free(job.deques);
+        free(job.counts);
+        free(threads);
+        CPDQS_PDQSORT(base, nmemb, size, compar, branchless, NULL, NULL);
+        return;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    pthread_cond_init(&job.work, NULL);
+    pthread_mutex_init(&job.splits.lock, NULL);
+    for (t = 0; t < nthreads; ++t) {
+        pthread_mutex_init(&job.deques[t].lock, NULL);
+    }
+
+    for (created = 1; created < nthreads; ++created) {
+        threads[created].job = &job;
+        threads[created].id = created;
+        if (pthread_create(
+                &threads[created].thread, NULL, CPDQS_V(par_thread_main),
+                &threads[created]) != 0) {
+            break;
+        }
+    }
+    threads[0].job = &job;
+    threads[0].id = 0;
+    job.nthreads = created;
+
+    top.begin = (char *)base;
+    top.end = (char *)base + nmemb * size;
+    CPDQS_LOG2(top.bad_allowed, nmemb);
+    top.is_leftmost = 1;
+    CPDQS_V(par_schedule)(&job, &top, 1);
+
+    pthread_mutex_lock(&job.lock);
+    job.started = 1;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+
+    CPDQS_V(par_thread_main)(&threads[0]);
+    for (t = 1; t < created; ++t) {
+        pthread_join(threads[t].thread, NULL);
+    }
+
+    for (t = 0; t < nthreads; ++t) {
+        pthread_mutex_destroy(&job.deques[t].lock);
+        free(job.deques[t].tasks);
+    }
+    pthread_mutex_destroy(&job.splits.lock);
+    free(job.splits.tasks);
+    pthread_cond_destroy(&job.work);
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+    free(job.deques);
+    free(job.counts);
+    free(threads);
+}
+
+
+/* Let's pretend it's a function, the way the others do */
+#define pdqsort_parallel(base, nmemb, _size, _compar, nthreads) \
+    CPDQS_V(par_pdqsort)((base), (nmemb), (_size), (_compar), CPDQS_BRANCHLESS, (nthreads))
+
+#define pdqsort_parallel_branchless(base, nmemb, _size, _compar, nthreads) \
+    CPDQS_V(par_pdqsort)((base), (nmemb), (_size), (_compar), 1, (nthreads))
+
+
+/* Batch of segments shared by the threads of pdqsort_many_parallel */
+struct CPDQS_V(par_many) {
+    pthread_mutex_t lock;
+    struct CPDQS_V(segment) const *segs;
+    char *base;
+    size_t const *offsets;
+    size_t nsegs;
+    size_t next;
+    size_t size;
+    int (* compar)(void const *, void const *);
+    int branchless;
+};
+
+/* Sorts the chunks of CPDQS_PAR_MANY_GRAIN segments until none are left. */
+CPDQS_FN void *CPDQS_V(par_many_main)(void *arg) {
+    struct CPDQS_V(par_many) *job = arg;
+    size_t first, n;
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        first = job->next;
+        n = job->nsegs - first;
+        if (n > CPDQS_PAR_MANY_GRAIN) {
+            n = CPDQS_PAR_MANY_GRAIN;
+        }
+        job->next = first + n;
+        pthread_mutex_unlock(&job->lock);
+
+        if (n == 0) {
+            break;
+        }
+        if (job->segs != NULL) {
+            CPDQS_MANY(
+                job->segs + first, NULL, NULL, n, job->size, job->compar, job->branchless);
+        } else {
+            CPDQS_MANY(
+                NULL, job->base, job->offsets + first, n,
+                job->size, job->compar, job->branchless);
+        }
+    }
+    return NULL;
+}
+
+
+/* pdqsort_many with all the parameters, on nthreads threads (0 - one per CPU). */
+CPDQS_FN void CPDQS_V(par_many)(
+        struct CPDQS_V(segment) const *segs, void *base, size_t const *offsets, size_t nsegs,
+        size_t size, int (* compar)(void const *, void const *), int branchless,
+        unsigned int nthreads) {
+    struct CPDQS_V(par_many) job;
+    pthread_t *threads = NULL;
+    unsigned int t, created;
+
+    if (nthreads == 0) {
+        nthreads = CPDQS_V(par_ncpus)();
+    }
+    if (nthreads > CPDQS_PAR_MAX_THREADS) {
+        nthreads = CPDQS_PAR_MAX_THREADS;
+    }
+    if (nthreads > 1 && nsegs >= 2 * CPDQS_PAR_MANY_GRAIN) {
+        threads = malloc(nthreads * sizeof(*threads));
+    }
+    if (threads == NULL) {
+        CPDQS_MANY(segs, base, offsets, nsegs, size, compar, branchless);
+        return;
+    }
+
+    job.segs = segs;
+    job.base = (char *)base;
+    job.offsets = offsets;
+    job.nsegs = nsegs;
+    job.next = 0;
+    job.size = size;
+    job.compar = compar;
+    job.branchless = branchless;
+    pthread_mutex_init(&job.lock, NULL);
+
+    for (created = 1; created < nthreads; ++created) {
+        if (pthread_create(&threads[created], NULL, CPDQS_V(par_many_main), &job) != 0) {
+            break;
+        }
+    }
+    CPDQS_V(par_many_main)(&job);
+    for (t = 1; t < created; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    free(threads);
+}
+
+
+/*
+pdqsort_many and pdqsort_many_csr on nthreads threads (0 - one per CPU),
+which take the segments a chunk at a time.
+*/
+#define pdqsort_many_parallel(segs, nsegs, _size, _compar, nthreads) \
+    CPDQS_V(par_many)( \
+        (segs), NULL, NULL, (nsegs), (_size), (_compar), CPDQS_BRANCHLESS, (nthreads))
+
+#define pdqsort_many_csr_parallel(base, offsets, nsegs, _size, _compar, nthreads) \
+    CPDQS_V(par_many)( \
+        NULL, (base), (offsets), (nsegs), (_size), (_compar), CPDQS_BRANCHLESS, (nthreads))
+
+
+
+/* Number of the samples per thread that pdqsort_merge_parallel splits the output by. */
+#ifndef CPDQS_PAR_MERGE_SAMPLES
+#define CPDQS_PAR_MERGE_SAMPLES 256
+#endif
+
+/* Element pos of the segment seg */
+struct CPDQS_V(par_merge_at) {
+    size_t seg;
+    size_t pos;
+};
+
+/* Merge of the sorted segments shared by the threads of pdqsort_merge_parallel */
+struct CPDQS_V(par_merge) {
+    struct CPDQS_V(segment) const *segs;
+    size_t k;
+    size_t size;
+    int (* compar)(void const *, void const *);
+    char *out;
+    unsigned int nslices;
+    struct CPDQS_V(par_merge_slice) *slices;
+    struct CPDQS_V(par_merge_at) *samples;
+};
+
+/* Slice of the output, with where it begins in the output and in each segment */
+struct CPDQS_V(par_merge_slice) {
+    struct CPDQS_V(par_merge) *job;
+    unsigned int id;
+    size_t begin;
+    size_t *split;
+    struct CPDQS_V(segment) *parts;
+    pthread_t thread;
+};
+
+#define CPDQS_PAR_MERGE_AT(job, at) \
+    ((char const *)(job)->segs[(at)->seg].base + (at)->pos * (job)->size)
+
+/* Orders the samples as the stable merge does: by value, then by segment and position */
+CPDQS_FN int CPDQS_V(par_merge_cmp)(void const *a, void const *b, void *arg) {
+    struct CPDQS_V(par_merge) const *job = arg;
+    struct CPDQS_V(par_merge_at) const *x = a, *y = b;
+    int c = job->compar(CPDQS_PAR_MERGE_AT(job, x), CPDQS_PAR_MERGE_AT(job, y));
+
+    if (c != 0) {
+        return c;
+    }
+    if (x->seg != y->seg) {
+        return (x->seg > y->seg) - (x->seg < y->seg);
+    }
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+/*
+Finds where the slice begins: before its pivot, the sample id *
+CPDQS_PAR_MERGE_SAMPLES, in the order of the stable merge. That takes one
+binary search per segment.
+*/
+CPDQS_FN void *CPDQS_V(par_merge_split)(void *arg) {
+    struct CPDQS_V(par_merge_slice) *self = arg;
+    struct CPDQS_V(par_merge) *job = self->job;
+    struct CPDQS_V(par_merge_at) const *pivot;
+    char const *p;
+    size_t i, lo, up, mid;
+    int c;
+
+    self->begin = 0;
+    if (self->id == 0) {
+        memset(self->split, 0, job->k * sizeof(*self->split));
+        return NULL;
+    }
+    pivot = &job->samples[(size_t)self->id * CPDQS_PAR_MERGE_SAMPLES];
+    p = CPDQS_PAR_MERGE_AT(job, pivot);
+
+    /* The elements of the earlier segments equal to the pivot go before it */
+    for (i = 0; i < job->k; ++i) {
+        lo = 0;
+        up = job->segs[i].nmemb;
+        if (i == pivot->seg) {
+            lo = pivot->pos;
+        }
+        while (lo < up && i != pivot->seg) {
+            mid = lo + (up - lo) / 2;
+            c = job->compar((char const *)job->segs[i].base + mid * job->size, p);
+            if (c < 0 || (c == 0 && i < pivot->seg)) {
+                lo = mid + 1;
+            } else {
+                up = mid;
+            }
+        }
+        self->split[i] = lo;
+        self->begin += lo;
+    }
+    return NULL;
+}
+
+/* Merges the non-empty parts of the segments up to where the next slice begins. */
+CPDQS_FN void *CPDQS_V(par_merge_main)(void *arg) {
+    struct CPDQS_V(par_merge_slice) *self = arg;
+    struct CPDQS_V(par_merge) *job = self->job;
+    size_t const *next = self->id + 1 < job->nslices ? job->slices[self->id + 1].split : NULL;
+    size_t i, nparts = 0, end;
+
+    for (i = 0; i < job->k; ++i) {
+        end = next != NULL ? next[i] : job->segs[i].nmemb;
+        if (end > self->split[i]) {
+            self->parts[nparts].base =
+                (char *)job->segs[i].base + self->split[i] * job->size;
+            self->parts[nparts].nmemb = end - self->split[i];
+            ++nparts;
+        }
+    }
+    CPDQS_V(merge_k)(
+        self->parts, nparts, job->size, job->compar, job->out + self->begin * job->size);
+    return NULL;
+}
+
+/*
+Runs fn on every slice, each on its own thread. The slices of the threads
+that could not be created are done by the calling thread.
+*/
+CPDQS_FN void CPDQS_V(par_merge_run)(
+        struct CPDQS_V(par_merge_slice) *slices, unsigned int nslices, void *(* fn)(void *)) {
+    unsigned int t, created;
+
+    for (created = 1; created < nslices; ++created) {
+        if (pthread_create(&slices[created].thread, NULL, fn, &slices[created]) != 0) {
+            break;
+        }
+    }
+    fn(&slices[0]);
+    for (t = created; t < nslices; ++t) {
+        fn(&slices[t]);
+    }
+    for (t = 1; t < created; ++t) {
+        pthread_join(slices[t].thread, NULL);
+    }
+}
+
+
+/*
+pdqsort_merge on nthreads threads (0 - one per CPU), with at least
+CPDQS_PAR_GRAIN elements per thread. The output is cut into a slice per
+thread by pivots picked once, out of CPDQS_PAR_MERGE_SAMPLES samples per
+thread taken at regular intervals of the segments. The threads find where
+their slices begin, and once all of them have, merge the slices.
+*/
+CPDQS_FN void CPDQS_V(par_merge)(
+        struct CPDQS_V(segment) const *segs, size_t k, size_t size,
+        int (* compar)(void const *, void const *), void *out, unsigned int nthreads) {
+    struct CPDQS_V(par_merge) job;
+    struct CPDQS_V(par_merge_slice) *slices = NULL;
+    struct CPDQS_V(par_merge_at) *samples = NULL;
+    size_t *splits = NULL;
+    struct CPDQS_V(segment) *parts = NULL;
+    size_t i, s, nsamples, total = 0, first, g;
+    unsigned int t;
+
+    for (i = 0; i < k; ++i) {
+        total += segs[i].nmemb;
+    }
+    if (nthreads == 0) {
+        nthreads = CPDQS_V(par_ncpus)();
+    }
+    if (nthreads > CPDQS_PAR_MAX_THREADS) {
+        nthreads = CPDQS_PAR_MAX_THREADS;
+    }
+    if (nthreads > total / CPDQS_PAR_GRAIN) {
+        nthreads = (unsigned int)(total / CPDQS_PAR_GRAIN);
+    }
+    nsamples = (size_t)nthreads * CPDQS_PAR_MERGE_SAMPLES;
+    if (nthreads > 1 && k > 1 && k < SIZE_MAX / CPDQS_PAR_MAX_THREADS / sizeof(*parts) &&
+            nsamples <= total) {
+        slices = malloc(nthreads * sizeof(*slices));
+        samples = malloc(nsamples * sizeof(*samples));
+        splits = malloc(nthreads * k * sizeof(*splits));
+        parts = malloc(nthreads * k * sizeof(*parts));
+    }
+    if (slices == NULL || samples == NULL || splits == NULL || parts == NULL) {
+        free(slices);
+        free(samples);
+        free(splits);
+        free(parts);
+        CPDQS_V(merge_k)(segs, k, size, compar, out);
+        return;
+    }
+
+    job.segs = segs;
+    job.k = k;
+    job.size = size;
+    job.compar = compar;
+    job.out = (char *)out;
+    job.nslices = nthreads;
+    job.slices = slices;
+    job.samples = samples;
+
+    /* The samples are taken from the middles of nsamples equal parts of the segments */
+    for (s = 0, i = 0, first = 0; s < nsamples; ++s) {
+        g = total / nsamples * s + total % nsamples * s / nsamples + total / nsamples / 2;
+        while (g >= first + segs[i].nmemb) {
+            first += segs[i].nmemb;
+            ++i;
+        }
+        samples[s].seg = i;
+        samples[s].pos = g - first;
+    }
+    pdqsort_r(samples, nsamples, sizeof(*samples), CPDQS_V(par_merge_cmp), &job);
+
+    for (t = 0; t < nthreads; ++t) {
+        slices[t].job = &job;
+        slices[t].id = t;
+        slices[t].split = splits + (size_t)t * k;
+        slices[t].parts = parts + (size_t)t * k;
+    }
+    CPDQS_V(par_merge_run)(slices, nthreads, CPDQS_V(par_merge_split));
+    CPDQS_V(par_merge_run)(slices, nthreads, CPDQS_V(par_merge_main));
+
+    free(slices);
+    free(samples);
+    free(splits);
+    free(parts);
+}
+
+
+/*
+pdqsort_merge on nthreads threads (0 - one per CPU), each merging its own
+slice of the output.
+*/
+#define pdqsort_merge_parallel(segs, nsegs, _size, _compar, out, nthreads) \
+    CPDQS_V(par_merge)((segs), (nsegs), (_size), (_compar), (out), (nthreads))
+
+#endif  /* __CPDQSORT_PARALLEL_H__ */